@@ -0,0 +1,222 @@
+#include "audio-mixer.hpp"
+#include "frame-writer.hpp"
+#include "pipeline-stats.hpp"
+#include <algorithm>
+#include <cstring>
+
+/* A source which has no frame is mixed as silence once another one has this
+ * many frames waiting, so that a stalled source doesn't stall the others */
+#define MAX_QUEUED_FRAMES 4
+
+/* Plain loops over non-aliasing buffers, which the compiler vectorizes */
+static void scale_samples(float *__restrict samples, float gain, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        samples[i] *= gain;
+}
+
+static void mix_samples(float *__restrict dst, const float *__restrict src,
+    float gain, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] += gain * src[i];
+}
+
+static void clip_samples(float *__restrict samples, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        samples[i] = std::min(std::max(samples[i], -1.0f), 1.0f);
+}
+
+AudioMixer::AudioMixer(const AudioMixerParams& _params)
+    : params(_params)
+{
+    nr_samples = params.audio_frame_size / sizeof(float);
+    frame_usec = nr_samples / 2 * 1000000ll / AUDIO_RATE;
+    scratch.resize(nr_samples);
+
+    for (auto& source : params.sources)
+    {
+        PulseReaderParams reader_params;
+        reader_params.audio_frame_size = params.audio_frame_size;
+        reader_params.audio_source = source.name.empty() ? NULL : source.name.c_str();
+        reader_params.on_frame = [=] () { wake_up(); };
+
+        std::unique_ptr<PulseReader> reader(new PulseReader(reader_params));
+        /* Separate tracks stay in the order of the sources, even if one of
+         * them is silent */
+        if (!reader->is_recording() && !params.separate_tracks)
+            continue;
+
+        readers.push_back(std::move(reader));
+        gains.push_back(source.gain);
+    }
+}
+
+void AudioMixer::start(int64_t origin_usec)
+{
+    if (readers.empty())
+        return;
+
+    clock_origin_usec = origin_usec;
+
+    mix_thread = std::thread([=] () { mix_loop(); });
+}
+
+void AudioMixer::wake_up()
+{
+    std::lock_guard<std::mutex> lock(wake_mutex);
+    woken = true;
+    wake_cv.notify_one();
+}
+
+void AudioMixer::mix_loop()
+{
+    while (true)
+    {
+        /* Check before mixing, so that everything read before recording
+         * stopped is still encoded */
+        bool done = mixing_done;
+        if (mix_frame(done))
+            continue;
+
+        if (done)
+            break;
+
+        /* Sleep until a source has a new frame, frames which arrived while
+         * mixing leave woken set */
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cv.wait(lock, [=] () { return woken; });
+        woken = false;
+    }
+}
+
+void AudioMixer::update_stats()
+{
+    if (!params.stats)
+        return;
+
+    size_t capacity = 0, fill_level = 0, overruns = 0;
+    for (auto& reader : readers)
+    {
+        capacity += reader->get_capacity();
+        fill_level += reader->get_fill_level();
+        overruns += reader->get_nr_overruns();
+    }
+
+    params.stats->audio_ring.set_limit(capacity);
+    params.stats->audio_ring.set_used(fill_level);
+    params.stats->audio_overruns = overruns;
+}
+
+bool AudioMixer::mix_frame(bool draining)
+{
+    update_stats();
+
+    size_t nr_ready = 0, nr_recording = 0;
+    bool source_behind = false;
+    for (auto& reader : readers)
+    {
+        if (!reader->is_recording())
+            continue;
+
+        ++nr_recording;
+        if (reader->has_frame())
+            ++nr_ready;
+        source_behind |= reader->get_fill_level() >=
+            MAX_QUEUED_FRAMES * params.audio_frame_size;
+    }
+
+    if (nr_ready == 0 ||
+        (nr_ready < nr_recording && !source_behind && !draining))
+    {
+        return false;
+    }
+
+    /* The frames start at the newest of their timestamps. Frames of sources
+     * which are behind by more than a frame are dropped, so that the
+     * sources stay aligned. */
+    int64_t usec = INT64_MIN;
+    for (auto& reader : readers)
+    {
+        if (reader->has_frame())
+            usec = std::max(usec, reader->get_frame_usec());
+    }
+
+    for (auto& reader : readers)
+    {
+        while (reader->has_frame() && reader->get_frame_usec() < usec - frame_usec)
+            reader->pop_frame(scratch.data());
+    }
+
+    int64_t paused_usec = pause_state.paused_usec;
+    bool paused = pause_state.paused || usec < pause_state.resume_usec;
+    usec -= clock_origin_usec + paused_usec;
+
+    /* Also drops what was buffered while the encoder was being opened */
+    if (paused || usec < 0)
+    {
+        for (auto& reader : readers)
+            reader->pop_frame(scratch.data());
+        return true;
+    }
+    auto writer = params.frame_writer;
+    if (params.separate_tracks)
+    {
+        for (size_t i = 0; i < readers.size(); i++)
+        {
+            float *samples = (float*)writer->get_audio_buffer(i);
+            if (!readers[i]->pop_frame(samples))
+            {
+                std::memset(samples, 0, params.audio_frame_size);
+                if (params.stats && readers[i]->is_recording())
+                    ++params.stats->audio_underruns;
+            }
+            else if (gains[i] != 1.0f)
+                scale_samples(samples, gains[i], nr_samples);
+
+            writer->add_audio(i, usec);
+        }
+
+        return true;
+    }
+
+    float *mix = (float*)writer->get_audio_buffer(0);
+    size_t nr_mixed = 0;
+    bool amplified = false;
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        float *samples = nr_mixed ? scratch.data() : mix;
+        if (!readers[i]->pop_frame(samples))
+        {
+            if (params.stats && readers[i]->is_recording())
+                ++params.stats->audio_underruns;
+            continue;
+        }
+
+        if (nr_mixed)
+            mix_samples(mix, samples, gains[i], nr_samples);
+        else if (gains[i] != 1.0f)
+            scale_samples(mix, gains[i], nr_samples);
+        ++nr_mixed;
+        amplified |= gains[i] > 1.0f;
+    }
+
+    if (nr_mixed > 1 || amplified)
+        clip_samples(mix, nr_samples);
+
+    writer->add_audio(0, usec);
+    return true;
+}
+
+AudioMixer::~AudioMixer()
+{
+    if (mix_thread.joinable())
+    {
+        mixing_done = true;
+        wake_up();
+        mix_thread.join();
+    }
+
+    readers.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef AUDIO_MIXER_HPP
+#define AUDIO_MIXER_HPP
+
+#include <stdint.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <string>
+#include "pulse.hpp"
+
+class FrameWriter;
+struct PipelineStats;
+
+/* Set when the recording is paused from the control socket. Audio captured while
+ * paused is dropped, and the time spent paused is cut from the timestamps. */
+struct PauseState
+{
+    std::atomic<bool> paused{false};
+    /* CLOCK_MONOTONIC time of the last resume, and the total time spent
+     * paused up to then, in microseconds */
+    std::atomic<int64_t> resume_usec{0};
+    std::atomic<int64_t> paused_usec{0};
+};
+
+extern PauseState pause_state;
+
+struct AudioSourceParams
+{
+    /* PulseAudio source, empty for the default one */
+    std::string name;
+    float gain;
+};
+
+struct AudioMixerParams
+{
+    /* Where the mixed audio is encoded */
+    FrameWriter *frame_writer;
+    /* Where the audio rings are accounted, can be NULL */
+    PipelineStats *stats;
+    size_t audio_frame_size;
+    std::vector<AudioSourceParams> sources;
+    /* Encode each source into its own track of the frame writer instead of
+     * mixing them into the first one */
+    bool separate_tracks;
+};
+
+/* Records several sources at once, each with its own PulseReader, and mixes
+ * their frames on a thread of its own before they are encoded. The sources
+ * are connected right away, but mixing only starts with start(). */
+class AudioMixer
+{
+    AudioMixerParams params;
+    std::vector<std::unique_ptr<PulseReader>> readers;
+    std::vector<float> gains;
+
+    /* Samples of the frame being added to the mix */
+    std::vector<float> scratch;
+    size_t nr_samples;
+    int64_t frame_usec;
+
+    /* CLOCK_MONOTONIC time of timestamp 0 of the video, in microseconds */
+    int64_t clock_origin_usec = 0;
+
+    /* Set by the read callbacks when a source has a new frame, and when
+     * mixing should stop */
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    bool woken = false;
+    void wake_up();
+
+    std::atomic<bool> mixing_done{false};
+    std::thread mix_thread;
+    void mix_loop();
+    bool mix_frame(bool draining);
+    void update_stats();
+
+    public:
+    AudioMixer(const AudioMixerParams& params);
+    ~AudioMixer();
+
+    /* Audio captured before clock_origin_usec is dropped */
+    void start(int64_t clock_origin_usec);
+};
+
+#endif /* end of include guard: AUDIO_MIXER_HPP */
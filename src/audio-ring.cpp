@@ -0,0 +1,82 @@
+#include "audio-ring.hpp"
+#include <algorithm>
+#include <cstring>
+
+AudioRing::AudioRing(size_t min_capacity)
+{
+    size_t capacity = 1;
+    while (capacity < min_capacity)
+        capacity <<= 1;
+
+    data.resize(capacity);
+    mask = capacity - 1;
+}
+
+bool AudioRing::push(const void *buffer, size_t size)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+
+    if (data.size() - (h - t) < size)
+    {
+        nr_overruns.fetch_add(1, std::memory_order_relaxed);
+        dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+        return false;
+    }
+
+    size_t start = h & mask;
+    size_t first = std::min(size, data.size() - start);
+    std::memcpy(&data[start], buffer, first);
+    std::memcpy(&data[0], (const char*)buffer + first, size - first);
+    head.store(h + size, std::memory_order_release);
+
+    size_t fill = h + size - t;
+    if (fill > peak_fill.load(std::memory_order_relaxed))
+        peak_fill.store(fill, std::memory_order_relaxed);
+
+    return true;
+}
+
+bool AudioRing::pop(void *buffer, size_t size)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+
+    if (h - t < size)
+        return false;
+
+    size_t start = t & mask;
+    size_t first = std::min(size, data.size() - start);
+    std::memcpy(buffer, &data[start], first);
+    std::memcpy((char*)buffer + first, &data[0], size - first);
+    tail.store(t + size, std::memory_order_release);
+
+    return true;
+}
+
+size_t AudioRing::get_capacity() const
+{
+    return data.size();
+}
+
+size_t AudioRing::get_fill_level() const
+{
+    /* Load tail first, head is never behind it */
+    size_t t = tail.load(std::memory_order_acquire);
+    return head.load(std::memory_order_acquire) - t;
+}
+
+size_t AudioRing::get_peak_fill_level() const
+{
+    return peak_fill.load(std::memory_order_relaxed);
+}
+
+size_t AudioRing::get_nr_overruns() const
+{
+    return nr_overruns.load(std::memory_order_relaxed);
+}
+
+size_t AudioRing::get_dropped_bytes() const
+{
+    return dropped_bytes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,44 @@
+#ifndef AUDIO_RING_HPP
+#define AUDIO_RING_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/* A lock-free single-producer/single-consumer ring of bytes, raw PCM or
+ * fixed-size records.
+ * push() is only called by the producer thread and pop() only by the
+ * consumer thread, neither of them ever blocks. */
+class AudioRing
+{
+    std::vector<char> data;
+    size_t mask;
+
+    /* Running byte counters, the positions in data are counter & mask */
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+
+    std::atomic<size_t> peak_fill{0};
+    std::atomic<size_t> nr_overruns{0};
+    std::atomic<size_t> dropped_bytes{0};
+
+    public:
+    /* The capacity is rounded up to a power of two */
+    AudioRing(size_t min_capacity);
+
+    /* Copy size bytes into the ring. If there isn't enough room, nothing is
+     * written, the overrun is accounted for and false is returned. */
+    bool push(const void *buffer, size_t size);
+
+    /* Copy size bytes out of the ring. Returns false and leaves the ring
+     * untouched if fewer than size bytes are available. */
+    bool pop(void *buffer, size_t size);
+
+    size_t get_capacity() const;
+    size_t get_fill_level() const;
+    size_t get_peak_fill_level() const;
+    size_t get_nr_overruns() const;
+    size_t get_dropped_bytes() const;
+};
+
+#endif /* end of include guard: AUDIO_RING_HPP */
@@ -0,0 +1,314 @@
+/* Feeds frames through FrameWriter as fast as possible, to compare
+ * conversion and encoder changes without a compositor. */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <getopt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "frame-writer.hpp"
+#include "raw-dump.hpp"
+
+/* Number of different synthetic frames, cycled through */
+#define NR_SYNTHETIC_FRAMES 4
+
+/* Frames are timestamped as if they were captured at this rate */
+#define BENCHMARK_FPS 60
+
+/* Moving gradients with some noise, so that the encoder can't just skip
+ * the frames */
+static std::vector<uint8_t> make_synthetic_frame(int width, int height, int index)
+{
+    std::vector<uint8_t> frame((size_t)width * height * 4);
+    uint32_t seed = 0x9e3779b9u * (index + 1);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint8_t *row = frame.data() + (size_t)y * width * 4;
+        for (int x = 0; x < width; x++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            uint8_t noise = seed >> 28;
+
+            row[4 * x + 0] = (x + index * 8) + noise;
+            row[4 * x + 1] = (y + index * 4) + noise;
+            row[4 * x + 2] = (x + y) / 2 + noise;
+            row[4 * x + 3] = 0;
+        }
+    }
+
+    return frame;
+}
+
+static uint64_t timeval_to_usec(const timeval& tv)
+{
+    return tv.tv_sec * 1000000ll + tv.tv_usec;
+}
+
+static void print_usage()
+{
+    printf("Usage: wf-recorder-bench [options]\n"
+        "  -s, --size WxH          frame size, default 1920x1080\n"
+        "  -n, --frames N          number of frames to encode, default 300\n"
+        "  -F, --format FMT        bgr0 or rgb0, default bgr0\n"
+        "  -r, --raw FILE          read frames from FILE instead of generating them,\n"
+        "                          either a dump made with wf-recorder --raw-dump or\n"
+        "                          tightly packed frames of the given size and format\n"
+        "  -f, --file FILE         output file, default wf-recorder-bench.mkv\n"
+        "  -c, --codec CODEC       default libx264\n"
+        "  -p, --codec-param K=V   codec option, can be repeated\n"
+        "  -d, --device DEVICE     vaapi device\n"
+        "  -t, --conversion-threads N\n");
+}
+
+int main(int argc, char *argv[])
+{
+    FrameWriterParams params;
+    params.file = "wf-recorder-bench.mkv";
+    params.streaming = false;
+    params.codec = "libx264";
+    params.width = 1920;
+    params.height = 1080;
+    params.format = INPUT_FORMAT_BGR0;
+    params.framerate = 0;
+    params.dmabuf = false;
+    params.audio_sync_offset = 0;
+    params.conversion_threads = 1;
+    params.encoder_threads = 0;
+    params.encoder_threading = ENCODER_THREADING_AUTO;
+    params.encoder_slices = 0;
+    params.muxer_queue_size = 64 << 20;
+    params.memory_budget = 0;
+    params.segment_usec = 0;
+    params.segment_size = 0;
+    params.segment_keep = 0;
+    params.enable_audio = false;
+    params.audio_tracks = 1;
+    params.damage_hints = false;
+    params.scale_source_format = AV_PIX_FMT_NONE;
+    params.scale_source_width = 0;
+    params.scale_source_height = 0;
+    params.enable_ffmpeg_debug_output = false;
+
+    PipelineStats stats;
+    params.stats = &stats;
+
+    int nr_frames = 300;
+    std::string raw_file;
+
+    struct option opts[] = {
+        { "size",            required_argument, NULL, 's' },
+        { "frames",          required_argument, NULL, 'n' },
+        { "format",          required_argument, NULL, 'F' },
+        { "raw",             required_argument, NULL, 'r' },
+        { "file",            required_argument, NULL, 'f' },
+        { "codec",           required_argument, NULL, 'c' },
+        { "codec-param",     required_argument, NULL, 'p' },
+        { "device",          required_argument, NULL, 'd' },
+        { "conversion-threads", required_argument, NULL, 't' },
+        { "help",            no_argument,       NULL, 'h' },
+        { 0,                 0,                 NULL,  0  }
+    };
+
+    int c, i;
+    std::string param;
+    size_t pos;
+    while((c = getopt_long(argc, argv, "s:n:F:r:f:c:p:d:t:h", opts, &i)) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &params.width, &params.height) != 2 ||
+                    params.width <= 0 || params.height <= 0)
+                {
+                    fprintf(stderr, "Invalid size %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'n':
+                nr_frames = std::max(1, atoi(optarg));
+                break;
+
+            case 'F':
+                if (!strcmp(optarg, "bgr0"))
+                    params.format = INPUT_FORMAT_BGR0;
+                else if (!strcmp(optarg, "rgb0"))
+                    params.format = INPUT_FORMAT_RGB0;
+                else
+                    printf("Invalid format %s\n", optarg);
+                break;
+
+            case 'r':
+                raw_file = optarg;
+                break;
+
+            case 'f':
+                params.file = optarg;
+                break;
+
+            case 'c':
+                params.codec = optarg;
+                break;
+
+            case 'd':
+                params.hw_device = optarg;
+                break;
+
+            case 't':
+                params.conversion_threads = std::max(1, atoi(optarg));
+                break;
+
+            case 'p':
+                param = optarg;
+                pos = param.find("=");
+                if (pos != std::string::npos && pos != param.length() - 1)
+                {
+                    auto optname = param.substr(0, pos);
+                    auto optvalue = param.substr(pos + 1, param.length() - pos - 1);
+                    params.codec_options[optname] = optvalue;
+                } else
+                {
+                    printf("Invalid codec option %s\n", optarg);
+                }
+                break;
+
+            case 'h':
+                print_usage();
+                return EXIT_SUCCESS;
+
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    std::unique_ptr<RawDumpReader> dump;
+    if (!raw_file.empty() && RawDumpReader::is_raw_dump(raw_file))
+    {
+        dump = std::unique_ptr<RawDumpReader> (new RawDumpReader(raw_file));
+        if (dump->get_nr_frames() == 0)
+        {
+            fprintf(stderr, "%s doesn't contain any frames\n", raw_file.c_str());
+            return EXIT_FAILURE;
+        }
+
+        auto layout = dump->get_layout();
+        params.format = layout.format;
+        params.width = layout.width;
+        params.height = layout.height;
+    }
+
+    size_t frame_size = (size_t)params.width * params.height * 4;
+    std::vector<const uint8_t*> frames;
+    int stride = params.width * 4;
+
+    std::vector<std::vector<uint8_t>> synthetic_frames;
+    void *raw_data = MAP_FAILED;
+    size_t raw_size = 0;
+    if (raw_file.empty())
+    {
+        for (int j = 0; j < NR_SYNTHETIC_FRAMES; j++)
+        {
+            synthetic_frames.push_back(
+                make_synthetic_frame(params.width, params.height, j));
+            frames.push_back(synthetic_frames.back().data());
+        }
+    } else if (dump)
+    {
+        stride = dump->get_layout().stride;
+        for (uint64_t j = 0; j < dump->get_nr_frames(); j++)
+        {
+            int64_t usec;
+            bool y_invert;
+            frames.push_back(dump->get_frame(j, usec, y_invert).pixels);
+        }
+    } else
+    {
+        int fd = open(raw_file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            fprintf(stderr, "failed to open %s: %m\n", raw_file.c_str());
+            return EXIT_FAILURE;
+        }
+
+        raw_size = st.st_size;
+        if (raw_size >= frame_size)
+            raw_data = mmap(NULL, raw_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (raw_data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s doesn't contain a single %dx%d frame\n",
+                raw_file.c_str(), params.width, params.height);
+            return EXIT_FAILURE;
+        }
+
+        /* Read it all once, so that page faults aren't counted */
+        madvise(raw_data, raw_size, MADV_WILLNEED);
+        for (size_t j = 0; j + frame_size <= raw_size; j += frame_size)
+            frames.push_back((const uint8_t*)raw_data + j);
+    }
+
+    FrameShm frame;
+    frame.format = params.format;
+    frame.width = params.width;
+    frame.height = params.height;
+    frame.stride = stride;
+
+    rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        FrameWriter writer(params);
+        for (int j = 0; j < nr_frames; j++)
+        {
+            frame.pixels = frames[j % frames.size()];
+            writer.add_frame(frame, (int64_t)j * 1000000 / BENCHMARK_FPS,
+                false, {});
+        }
+
+        /* Flushing the encoder is part of the work */
+    }
+
+    double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / 1e6;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    uint64_t cpu_usec =
+        timeval_to_usec(usage_end.ru_utime) - timeval_to_usec(usage_start.ru_utime) +
+        timeval_to_usec(usage_end.ru_stime) - timeval_to_usec(usage_start.ru_stime);
+
+    std::string options;
+    for (auto& option : params.codec_options)
+        options += " " + option.first + "=" + option.second;
+
+    printf("codec=%s%s size=%dx%d format=%s source=%s frames=%d\n",
+        params.codec.c_str(), options.c_str(), params.width, params.height,
+        params.format == INPUT_FORMAT_BGR0 ? "bgr0" : "rgb0",
+        raw_file.empty() ? "synthetic" : raw_file.c_str(), nr_frames);
+    printf("fps=%.1f cpu_ms_per_frame=%.2f peak_rss_mb=%.1f\n",
+        nr_frames / elapsed, cpu_usec / 1000.0 / nr_frames,
+        usage_end.ru_maxrss / 1024.0);
+    fflush(stdout);
+
+    stats.print_summary(std::cout, "bench");
+
+    if (raw_data != MAP_FAILED)
+        munmap(raw_data, raw_size);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#include "control-socket.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Clients sending longer lines are disconnected */
+#define MAX_COMMAND_SIZE 4096
+#define MAX_CLIENTS 16
+
+ControlSocket::ControlSocket(const std::string& _path, CommandHandler _handler)
+    : path(_path), handler(_handler)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Control socket path too long: " << path << std::endl;
+        std::exit(-1);
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        std::cerr << "Failed to create the control socket: " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    /* A socket left behind by a previous instance which didn't exit cleanly
+     * refuses connections, while one still in use has to be left alone */
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe_fd >= 0)
+    {
+        if (connect(probe_fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            std::cerr << "Control socket " << path << " is in use by another instance" << std::endl;
+            std::exit(-1);
+        }
+
+        if (errno == ECONNREFUSED)
+            unlink(path.c_str());
+        close(probe_fd);
+    }
+
+    /* Only the user may send commands */
+    mode_t old_umask = umask(0177);
+    int ret = bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (ret < 0 || listen(listen_fd, MAX_CLIENTS) < 0)
+    {
+        std::cerr << "Failed to listen on " << path << ": " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+}
+
+ControlSocket::~ControlSocket()
+{
+    for (auto& client : clients)
+        close(client.fd);
+    close(listen_fd);
+    unlink(path.c_str());
+}
+
+void ControlSocket::add_poll_fds(std::vector<pollfd>& fds)
+{
+    fds.push_back({listen_fd, POLLIN, 0});
+    for (auto& client : clients)
+        fds.push_back({client.fd, POLLIN, 0});
+}
+
+void ControlSocket::dispatch(const std::vector<pollfd>& fds)
+{
+    std::vector<Client> connected;
+    for (auto& client : clients)
+    {
+        bool readable = false;
+        for (auto& pfd : fds)
+            readable |= pfd.fd == client.fd && pfd.revents;
+
+        if (!readable || read_commands(client))
+            connected.push_back(client);
+        else
+            close(client.fd);
+    }
+    clients = connected;
+
+    for (auto& pfd : fds)
+    {
+        if (pfd.fd == listen_fd && (pfd.revents & POLLIN))
+            accept_clients();
+    }
+}
+
+void ControlSocket::accept_clients()
+{
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (clients.size() >= MAX_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+
+        clients.push_back({fd, ""});
+    }
+}
+
+bool ControlSocket::read_commands(Client& client)
+{
+    char buffer[1024];
+    ssize_t size;
+    while ((size = read(client.fd, buffer, sizeof(buffer))) > 0)
+        client.input.append(buffer, size);
+
+    /* 0 means the client closed the connection */
+    bool closed = size == 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+
+    size_t end;
+    while ((end = client.input.find('\n')) != std::string::npos)
+    {
+        auto command = client.input.substr(0, end);
+        client.input.erase(0, end + 1);
+        if (!command.empty() && command.back() == '\r')
+            command.pop_back();
+
+        /* Replies are short, a client which doesn't read them is dropped
+         * instead of blocking the capture loop */
+        auto reply = handler(command) + "\n";
+        if (send(client.fd, reply.data(), reply.size(),
+            MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)reply.size())
+        {
+            return false;
+        }
+    }
+
+    return !closed && client.input.size() <= MAX_COMMAND_SIZE;
+}
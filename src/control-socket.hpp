@@ -0,0 +1,44 @@
+#ifndef CONTROL_SOCKET_HPP
+#define CONTROL_SOCKET_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <poll.h>
+
+/* A Unix socket accepting one command per line, each answered with one line.
+ * It doesn't have a thread of its own: its fds are polled together with the
+ * Wayland display in the capture loop, which then calls dispatch(). */
+class ControlSocket
+{
+    public:
+    /* Returns the reply to a command, without the newline */
+    using CommandHandler = std::function<std::string(const std::string& command)>;
+
+    ControlSocket(const std::string& path, CommandHandler handler);
+    ~ControlSocket();
+
+    /* Add the fds to wait for to the poll set */
+    void add_poll_fds(std::vector<pollfd>& fds);
+    /* Accept clients and run their commands, given the poll set after poll() */
+    void dispatch(const std::vector<pollfd>& fds);
+
+    private:
+    struct Client
+    {
+        int fd;
+        /* Data received after the last complete command */
+        std::string input;
+    };
+
+    std::string path;
+    CommandHandler handler;
+    int listen_fd = -1;
+    std::vector<Client> clients;
+
+    void accept_clients();
+    /* Returns false if the client has to be disconnected */
+    bool read_commands(Client& client);
+};
+
+#endif /* end of include guard: CONTROL_SOCKET_HPP */
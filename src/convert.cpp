@@ -0,0 +1,279 @@
+// Fast paths for the packed RGB -> YUV420P conversion, used instead of swscale
+// when the CPU supports them. The coefficients are the usual fixed-point BT.601
+// ones, Y with 7 bits of precision so that they fit in signed bytes.
+
+#include "convert.hpp"
+
+extern "C"
+{
+    #include <libavutil/cpu.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_CONVERTER 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_CONVERTER 1
+#endif
+
+struct conversion_coefficients
+{
+    /* In the order of the bytes of a pixel */
+    int8_t y[4], u[4], v[4];
+};
+
+static const conversion_coefficients bgr0_coefficients = {
+    {13, 64, 33, 0}, {112, -74, -38, 0}, {-18, -94, 112, 0},
+};
+
+static const conversion_coefficients rgb0_coefficients = {
+    {33, 64, 13, 0}, {-38, -74, 112, 0}, {112, -94, -18, 0},
+};
+
+static inline uint8_t get_luma(const int8_t k[4], const uint8_t *px)
+{
+    return ((k[0] * px[0] + k[1] * px[1] + k[2] * px[2] + 64) >> 7) + 16;
+}
+
+static inline uint8_t get_chroma(const int8_t k[4], const int avg[3])
+{
+    return ((k[0] * avg[0] + k[1] * avg[1] + k[2] * avg[2] + 128) >> 8) + 128;
+}
+
+/* Convert the pixels [x, width) of one luma row */
+static void convert_luma_tail(const uint8_t *src, uint8_t *dst, int x, int width,
+    const conversion_coefficients& k)
+{
+    for (; x < width; x++)
+        dst[x] = get_luma(k.y, src + 4 * x);
+}
+
+/* Convert the 2x2 blocks starting at columns [x, width) of two rows.
+ * row0 and row1 may be the same row, at the bottom of an odd-sized band. */
+static void convert_chroma_tail(const uint8_t *row0, const uint8_t *row1,
+    uint8_t *dst_u, uint8_t *dst_v, int x, int width,
+    const conversion_coefficients& k)
+{
+    for (; x < width; x += 2)
+    {
+        /* The last column of an odd-sized image has no right neighbour */
+        int next = (x + 1 < width) ? 4 : 0;
+        const uint8_t *p0 = row0 + 4 * x, *p1 = row1 + 4 * x;
+
+        int avg[3];
+        for (int c = 0; c < 3; c++)
+            avg[c] = (p0[c] + p0[c + next] + p1[c] + p1[c + next] + 2) >> 2;
+
+        dst_u[x / 2] = get_chroma(k.u, avg);
+        dst_v[x / 2] = get_chroma(k.v, avg);
+    }
+}
+
+#ifdef HAVE_AVX2_CONVERTER
+/* One pixel worth of coefficients, to be broadcast to a whole register */
+static inline int32_t pack_coefficients(const int8_t k[4])
+{
+    return (uint8_t)k[0] | ((uint8_t)k[1] << 8) | ((uint8_t)k[2] << 16);
+}
+
+__attribute__((target("avx2")))
+static void convert_luma_avx2(const uint8_t *src, uint8_t *dst, int width,
+    const conversion_coefficients& k)
+{
+    const __m256i ky = _mm256_set1_epi32(pack_coefficients(k.y));
+    const __m256i round = _mm256_set1_epi16(64);
+    const __m256i offset = _mm256_set1_epi16(16);
+    /* hadd and packus work on 128-bit lanes, this puts the pixels back in order */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + 4 * x));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 4 * x + 32));
+
+        __m256i y = _mm256_hadd_epi16(_mm256_maddubs_epi16(a, ky),
+            _mm256_maddubs_epi16(b, ky));
+        y = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(y, round), 7), offset);
+        y = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(y, y), order);
+
+        _mm_storeu_si128((__m128i*)(dst + x), _mm256_castsi256_si128(y));
+    }
+
+    convert_luma_tail(src, dst, x, width, k);
+}
+
+/* The 2x2 block averages of 8 pixels of two rows, 16 bits per channel.
+ * Lane 0 has blocks 0 and 1, lane 1 has blocks 2 and 3. */
+__attribute__((target("avx2")))
+static inline __m256i average_blocks_avx2(const uint8_t *row0, const uint8_t *row1)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi16(2);
+
+    /* Pixels 0,1 and 4,5 in lo, pixels 2,3 and 6,7 in hi */
+    __m256i p0 = _mm256_loadu_si256((const __m256i*)row0);
+    __m256i p1 = _mm256_loadu_si256((const __m256i*)row1);
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(p0, zero),
+        _mm256_unpacklo_epi8(p1, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(p0, zero),
+        _mm256_unpackhi_epi8(p1, zero));
+
+    __m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi),
+        _mm256_unpackhi_epi64(lo, hi));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, round), 2);
+}
+
+__attribute__((target("avx2")))
+static void convert_chroma_avx2(const uint8_t *row0, const uint8_t *row1,
+    uint8_t *dst_u, uint8_t *dst_v, int width, const conversion_coefficients& k)
+{
+    const __m256i ku = _mm256_set1_epi32(pack_coefficients(k.u));
+    const __m256i kv = _mm256_set1_epi32(pack_coefficients(k.v));
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i offset = _mm256_set1_epi16(128);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        /* Average with the same rounding as convert_chroma_tail(), so the
+         * columns it converts don't stand out */
+        __m256i avg = _mm256_packus_epi16(
+            average_blocks_avx2(row0 + 4 * x, row1 + 4 * x),
+            average_blocks_avx2(row0 + 4 * x + 32, row1 + 4 * x + 32));
+
+        /* Lane 0 has blocks 0,1,4,5 and lane 1 has blocks 2,3,6,7,
+         * U followed by V in each lane */
+        __m256i uv = _mm256_hadd_epi16(_mm256_maddubs_epi16(avg, ku),
+            _mm256_maddubs_epi16(avg, kv));
+        uv = _mm256_add_epi16(_mm256_srai_epi16(_mm256_add_epi16(uv, round), 8), offset);
+        uv = _mm256_packus_epi16(uv, uv);
+
+        __m128i ordered = _mm_unpacklo_epi16(_mm256_castsi256_si128(uv),
+            _mm256_extracti128_si256(uv, 1));
+        _mm_storel_epi64((__m128i*)(dst_u + x / 2), ordered);
+        _mm_storel_epi64((__m128i*)(dst_v + x / 2), _mm_srli_si128(ordered, 8));
+    }
+
+    convert_chroma_tail(row0, row1, dst_u, dst_v, x, width, k);
+}
+
+static void convert_yuv420p_avx2(const uint8_t *src, int src_stride,
+    int width, int height, uint8_t *const dst[3], const int dst_stride[3], bool bgr)
+{
+    const conversion_coefficients& k = bgr ? bgr0_coefficients : rgb0_coefficients;
+    for (int y = 0; y < height; y += 2)
+    {
+        const uint8_t *row0 = src + y * src_stride;
+        const uint8_t *row1 = (y + 1 < height) ? row0 + src_stride : row0;
+
+        convert_luma_avx2(row0, dst[0] + y * dst_stride[0], width, k);
+        if (row1 != row0)
+            convert_luma_avx2(row1, dst[0] + (y + 1) * dst_stride[0], width, k);
+
+        convert_chroma_avx2(row0, row1, dst[1] + y / 2 * dst_stride[1],
+            dst[2] + y / 2 * dst_stride[2], width, k);
+    }
+}
+#endif
+
+#ifdef HAVE_NEON_CONVERTER
+static void convert_luma_neon(const uint8_t *src, uint8_t *dst, int width,
+    const conversion_coefficients& k)
+{
+    const uint8x8_t k0 = vdup_n_u8(k.y[0]);
+    const uint8x8_t k1 = vdup_n_u8(k.y[1]);
+    const uint8x8_t k2 = vdup_n_u8(k.y[2]);
+    const uint8x8_t offset = vdup_n_u8(16);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x4_t px = vld4q_u8(src + 4 * x);
+
+        uint16x8_t lo = vmull_u8(vget_low_u8(px.val[0]), k0);
+        lo = vmlal_u8(lo, vget_low_u8(px.val[1]), k1);
+        lo = vmlal_u8(lo, vget_low_u8(px.val[2]), k2);
+
+        uint16x8_t hi = vmull_u8(vget_high_u8(px.val[0]), k0);
+        hi = vmlal_u8(hi, vget_high_u8(px.val[1]), k1);
+        hi = vmlal_u8(hi, vget_high_u8(px.val[2]), k2);
+
+        vst1q_u8(dst + x, vcombine_u8(
+            vadd_u8(vrshrn_n_u16(lo, 7), offset),
+            vadd_u8(vrshrn_n_u16(hi, 7), offset)));
+    }
+
+    convert_luma_tail(src, dst, x, width, k);
+}
+
+static inline uint8x8_t get_chroma_neon(const int8_t k[4], const int16x8_t avg[3])
+{
+    int16x8_t c = vmulq_n_s16(avg[0], k[0]);
+    c = vmlaq_n_s16(c, avg[1], k[1]);
+    c = vmlaq_n_s16(c, avg[2], k[2]);
+    return vqmovun_s16(vaddq_s16(vrshrq_n_s16(c, 8), vdupq_n_s16(128)));
+}
+
+static void convert_chroma_neon(const uint8_t *row0, const uint8_t *row1,
+    uint8_t *dst_u, uint8_t *dst_v, int width, const conversion_coefficients& k)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x4_t p0 = vld4q_u8(row0 + 4 * x);
+        uint8x16x4_t p1 = vld4q_u8(row1 + 4 * x);
+
+        int16x8_t avg[3];
+        for (int c = 0; c < 3; c++)
+        {
+            uint16x8_t sum = vpadalq_u8(vpaddlq_u8(p0.val[c]), p1.val[c]);
+            avg[c] = vreinterpretq_s16_u16(vrshrq_n_u16(sum, 2));
+        }
+
+        vst1_u8(dst_u + x / 2, get_chroma_neon(k.u, avg));
+        vst1_u8(dst_v + x / 2, get_chroma_neon(k.v, avg));
+    }
+
+    convert_chroma_tail(row0, row1, dst_u, dst_v, x, width, k);
+}
+
+static void convert_yuv420p_neon(const uint8_t *src, int src_stride,
+    int width, int height, uint8_t *const dst[3], const int dst_stride[3], bool bgr)
+{
+    const conversion_coefficients& k = bgr ? bgr0_coefficients : rgb0_coefficients;
+    for (int y = 0; y < height; y += 2)
+    {
+        const uint8_t *row0 = src + y * src_stride;
+        const uint8_t *row1 = (y + 1 < height) ? row0 + src_stride : row0;
+
+        convert_luma_neon(row0, dst[0] + y * dst_stride[0], width, k);
+        if (row1 != row0)
+            convert_luma_neon(row1, dst[0] + (y + 1) * dst_stride[0], width, k);
+
+        convert_chroma_neon(row0, row1, dst[1] + y / 2 * dst_stride[1],
+            dst[2] + y / 2 * dst_stride[2], width, k);
+    }
+}
+#endif
+
+yuv420p_converter find_yuv420p_converter()
+{
+    int flags = av_get_cpu_flags();
+    (void)flags;
+
+#ifdef HAVE_AVX2_CONVERTER
+    if (flags & AV_CPU_FLAG_AVX2)
+        return convert_yuv420p_avx2;
+#endif
+
+#ifdef HAVE_NEON_CONVERTER
+    if (flags & AV_CPU_FLAG_NEON)
+        return convert_yuv420p_neon;
+#endif
+
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef CONVERT_HPP
+#define CONVERT_HPP
+
+#include <stdint.h>
+
+/* Converts a band of rows of a packed 32-bit BGR0/RGB0 image to YUV420P
+ * (BT.601, limited range).
+ *
+ * src points to the first row of the band. If src_stride is negative, the
+ * rows are read bottom-up, which flips the image vertically in the same pass.
+ * dst contains pointers to the first row of the band in each plane. height
+ * should be even, except for the last band of an image with odd height. */
+typedef void (*yuv420p_converter)(const uint8_t *src, int src_stride,
+    int width, int height, uint8_t *const dst[3], const int dst_stride[3], bool bgr);
+
+/* Find the fastest converter supported by the CPU.
+ * Returns NULL if there is no SIMD implementation for it. */
+yuv420p_converter find_yuv420p_converter();
+
+#endif /* end of include guard: CONVERT_HPP */
@@ -5,13 +5,39 @@
 
 #include <iostream>
 #include "frame-writer.hpp"
+#include "rendition.hpp"
 #include <vector>
 #include <queue>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
 
-#define FPS 60
+extern "C"
+{
+    #include <libavutil/imgutils.h>
+}
+
+/* Frames are timestamped with the compositor's presentation time, so the
+ * video has a variable framerate in microseconds */
+#define VIDEO_TIME_BASE (AVRational){ 1, 1000000 }
 #define PIX_FMT AV_PIX_FMT_YUV420P
 #define AUDIO_RATE 44100
+/* Quantizer offset of the undamaged parts of the frame with --damage-hints,
+ * in AVRegionOfInterest units (x264 maps 1 to +25 QP). Enough for the encoder
+ * to skip the static macroblocks, which it mostly does already. */
+#define DAMAGE_HINT_QOFFSET (AVRational){ 1, 5 }
+
+/* More threads than this make x264 and libvpx slower, not faster */
+#define MAX_AUTO_ENCODER_THREADS 16
+
+/* Microseconds a network write may block before it fails */
+#define STREAM_IO_TIMEOUT "5000000"
+
+/* Lower limits when sizing the buffers from params.memory_budget. Less than
+ * this makes the encoder or the muxer stall. */
+#define MIN_HW_POOL_SIZE 8
+#define MIN_MUXER_QUEUE_SIZE (1 << 20)
 
 using namespace std;
 
@@ -28,10 +54,47 @@ public :
 
 static FFmpegInitialize ffmpegInitialize;
 
+/* How frames get to a hardware encoder */
+struct HwBackend
+{
+    /* Encoders whose name contains this use the backend */
+    const char *codec_api;
+    AVHWDeviceType device_type;
+    AVPixelFormat hw_format;
+    /* Format of the surfaces, AV_PIX_FMT_NONE for the captured format */
+    AVPixelFormat sw_format;
+    /* Whether the captured pixels can be uploaded to sw_format surfaces,
+     * converting them on the way */
+    bool converts_on_upload;
+    /* Surfaces allocated up front, 0 if the pool grows on demand */
+    int pool_size;
+};
+
+static const HwBackend hw_backends[] = {
+    /* The driver converts RGB to NV12 while uploading */
+    { "vaapi", AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, AV_PIX_FMT_NV12, true, 0 },
+    /* NVENC takes RGB surfaces and converts them itself */
+    { "nvenc", AV_HWDEVICE_TYPE_CUDA, AV_PIX_FMT_CUDA, AV_PIX_FMT_NONE, false, 0 },
+    /* QSV needs a fixed pool of NV12 surfaces, converted on the CPU. Large
+     * enough for the encoder's lookahead and the frames being uploaded. */
+    { "qsv", AV_HWDEVICE_TYPE_QSV, AV_PIX_FMT_QSV, AV_PIX_FMT_NV12, false, 32 },
+};
+
+static const HwBackend *find_hw_backend(const std::string& codec)
+{
+    for (auto& backend : hw_backends)
+    {
+        if (codec.find(backend.codec_api) != std::string::npos)
+            return &backend;
+    }
+
+    return NULL;
+}
+
 void FrameWriter::init_hw_accel()
 {
-    int ret = av_hwdevice_ctx_create(&this->hw_device_context,
-        av_hwdevice_find_type_by_name("vaapi"), params.hw_device.c_str(), NULL, 0);
+    int ret = av_hwdevice_ctx_create(&this->hw_device_context, hw_backend->device_type,
+        params.hw_device.empty() ? NULL : params.hw_device.c_str(), NULL, 0);
 
     if (ret != 0)
     {
@@ -39,6 +102,12 @@ void FrameWriter::init_hw_accel()
         std::exit(-1);
     }
 
+    if (params.dmabuf)
+    {
+        init_dmabuf_import();
+        return;
+    }
+
     this->hw_frame_context = av_hwframe_ctx_alloc(hw_device_context);
     if (!this->hw_frame_context)
     {
@@ -60,7 +129,38 @@ void FrameWriter::init_hw_accel()
     ctx->width = params.width;
     ctx->height = params.height;
     ctx->format = cst->valid_hw_formats[0];
-    ctx->sw_format = AV_PIX_FMT_NV12;
+    ctx->initial_pool_size = hw_backend->pool_size;
+    av_hwframe_constraints_free(&cst);
+
+    /* Fixed pools get up to half of the memory budget, the muxer queues
+     * the rest */
+    if (hw_backend->pool_size)
+    {
+        size_t surface_size = std::max(1, av_image_get_buffer_size(
+            hw_backend->sw_format, params.width, params.height, 1));
+        if (params.memory_budget)
+        {
+            size_t fit = params.memory_budget / 2 / surface_size;
+            ctx->initial_pool_size = std::min<size_t>(hw_backend->pool_size,
+                std::max<size_t>(MIN_HW_POOL_SIZE, fit));
+        }
+
+        hw_pool_bytes = surface_size * ctx->initial_pool_size;
+        if (params.stats)
+        {
+            params.stats->hw_surfaces.set_limit(hw_pool_bytes);
+            params.stats->hw_surfaces.set_used(hw_pool_bytes);
+        }
+    }
+
+    conversion_format = hw_backend->converts_on_upload ?
+        AV_PIX_FMT_NONE : hw_backend->sw_format;
+
+    if (hw_backend->sw_format != AV_PIX_FMT_NONE)
+        ctx->sw_format = hw_backend->sw_format;
+    else
+        ctx->sw_format = params.format == INPUT_FORMAT_RGB0 ?
+            AV_PIX_FMT_RGB0 : AV_PIX_FMT_BGR0;
 
     if (av_hwframe_ctx_init(hw_frame_context))
     {
@@ -71,6 +171,97 @@ void FrameWriter::init_hw_accel()
     }
 }
 
+void FrameWriter::init_dmabuf_import()
+{
+    /* dmabufs are described as DRM PRIME frames, which are then mapped to the
+     * VAAPI device, so the DRM device has to be derived from it */
+    if (av_hwdevice_ctx_create_derived(&drm_device_context,
+        AV_HWDEVICE_TYPE_DRM, hw_device_context, 0) < 0)
+    {
+        std::cerr << "Failed to derive a DRM device from " << params.hw_device << std::endl;
+        std::exit(-1);
+    }
+
+    drm_frame_context = av_hwframe_ctx_alloc(drm_device_context);
+    if (!drm_frame_context)
+    {
+        std::cerr << "Failed to initialize DRM frame context" << std::endl;
+        std::exit(-1);
+    }
+
+    AVHWFramesContext *ctx = (AVHWFramesContext*)drm_frame_context->data;
+    ctx->width = params.width;
+    ctx->height = params.height;
+    ctx->format = AV_PIX_FMT_DRM_PRIME;
+    ctx->sw_format = params.format == INPUT_FORMAT_RGB0 ?
+        AV_PIX_FMT_RGB0 : AV_PIX_FMT_BGR0;
+
+    if (av_hwframe_ctx_init(drm_frame_context))
+    {
+        std::cerr << "Failed to initialize DRM frame context" << std::endl;
+        std::exit(-1);
+    }
+
+    dmabuf_graph = avfilter_graph_alloc();
+    if (!dmabuf_graph)
+    {
+        std::cerr << "Failed to allocate filter graph" << std::endl;
+        std::exit(-1);
+    }
+
+    char args[256];
+    snprintf(args, sizeof(args),
+        "video_size=%dx%d:pix_fmt=%d:time_base=1/1000000:pixel_aspect=1/1",
+        params.width, params.height, AV_PIX_FMT_DRM_PRIME);
+
+    if (avfilter_graph_create_filter(&dmabuf_src, avfilter_get_by_name("buffer"),
+            "in", args, NULL, dmabuf_graph) < 0 ||
+        avfilter_graph_create_filter(&dmabuf_sink, avfilter_get_by_name("buffersink"),
+            "out", NULL, NULL, dmabuf_graph) < 0)
+    {
+        std::cerr << "Failed to create dmabuf filters" << std::endl;
+        std::exit(-1);
+    }
+
+    AVBufferSrcParameters *src_params = av_buffersrc_parameters_alloc();
+    src_params->hw_frames_ctx = drm_frame_context;
+    int err = av_buffersrc_parameters_set(dmabuf_src, src_params);
+    av_free(src_params);
+    if (err < 0)
+    {
+        std::cerr << "Failed to set dmabuf source parameters" << std::endl;
+        std::exit(-1);
+    }
+
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = dmabuf_src;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = dmabuf_sink;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    /* Map the dmabuf to a VAAPI surface and let the video processor convert
+     * it to NV12, so that the pixels never leave the GPU */
+    err = avfilter_graph_parse_ptr(dmabuf_graph,
+        "hwmap=mode=direct:derive_device=vaapi,scale_vaapi=format=nv12",
+        &inputs, &outputs, NULL);
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+
+    if (err < 0 || avfilter_graph_config(dmabuf_graph, NULL) < 0)
+    {
+        std::cerr << "Failed to configure dmabuf filter graph" << std::endl;
+        std::exit(-1);
+    }
+
+    hw_frame_context = av_buffer_ref(av_buffersink_get_hw_frames_ctx(dmabuf_sink));
+}
+
 void FrameWriter::load_codec_options(AVDictionary **dict)
 {
     static const std::map<std::string, std::string> default_x264_options = {
@@ -88,6 +279,14 @@ void FrameWriter::load_codec_options(AVDictionary **dict)
         }
     }
 
+    /* x264 ignores the damage hints without adaptive quantization, which
+     * the ultrafast preset turns off */
+    if (params.damage_hints && !params.codec.compare("libx264") &&
+        !params.codec_options.count("aq-mode"))
+    {
+        params.codec_options["aq-mode"] = "variance";
+    }
+
     for (auto& opt : params.codec_options)
     {
         std::cout << "Setting codec option: " << opt.first << "=" << opt.second << std::endl;
@@ -95,6 +294,114 @@ void FrameWriter::load_codec_options(AVDictionary **dict)
     }
 }
 
+/* YUV420P, unless the encoder only takes NV12, like most V4L2 M2M
+ * encoders. They copy the frames into their own queue of V4L2 buffers. */
+static AVPixelFormat get_codec_pix_fmt(AVCodec *codec)
+{
+    if (!codec->pix_fmts)
+        return PIX_FMT;
+
+    bool nv12 = false;
+    for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++)
+    {
+        if (codec->pix_fmts[i] == PIX_FMT)
+            return PIX_FMT;
+        if (codec->pix_fmts[i] == AV_PIX_FMT_NV12)
+            nv12 = true;
+    }
+
+    return nv12 ? AV_PIX_FMT_NV12 : PIX_FMT;
+}
+
+static bool is_hw_encoder(const std::string& codec)
+{
+    static const char *hw_apis[] = { "vaapi", "nvenc", "qsv", "v4l2m2m", "omx" };
+    for (auto api : hw_apis)
+    {
+        if (codec.find(api) != std::string::npos)
+            return true;
+    }
+
+    return false;
+}
+
+/* Software encoders don't all default to using several threads, libvpx for
+ * example runs single-threaded unless told otherwise */
+void FrameWriter::init_encoder_threading(AVCodec *codec)
+{
+    if (is_hw_encoder(params.codec))
+    {
+        if (params.encoder_threads > 0 ||
+            params.encoder_threading != ENCODER_THREADING_AUTO)
+        {
+            std::cerr << "Ignoring encoder threading options for hardware encoder "
+                << params.codec << std::endl;
+        }
+
+        if (params.encoder_slices > 0)
+            videoCodecCtx->slices = params.encoder_slices;
+        return;
+    }
+
+    int threads = params.encoder_threads;
+    if (threads <= 0)
+    {
+        threads = std::min<int>(MAX_AUTO_ENCODER_THREADS,
+            std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    /* External libraries like x264 do their own threading, and take both
+     * kinds. libavcodec's own encoders only support what they advertise,
+     * so fall back to the other kind, or to the default, instead of passing
+     * an unsupported one on. */
+    bool own_threads = codec->capabilities & AV_CODEC_CAP_AUTO_THREADS;
+    bool frame_ok = own_threads || (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS);
+    bool slice_ok = own_threads || (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS);
+    switch (params.encoder_threading)
+    {
+        case ENCODER_THREADING_FRAME:
+            if (frame_ok)
+            {
+                videoCodecCtx->thread_type = FF_THREAD_FRAME;
+            } else if (slice_ok)
+            {
+                std::cerr << params.codec << " doesn't support frame threading, "
+                    "using slice threading" << std::endl;
+                videoCodecCtx->thread_type = FF_THREAD_SLICE;
+            } else
+            {
+                std::cerr << params.codec << " doesn't support frame threading, "
+                    "using its default" << std::endl;
+            }
+            break;
+
+        case ENCODER_THREADING_SLICE:
+            if (slice_ok)
+            {
+                videoCodecCtx->thread_type = FF_THREAD_SLICE;
+            } else if (frame_ok)
+            {
+                std::cerr << params.codec << " doesn't support slice threading, "
+                    "using frame threading" << std::endl;
+                videoCodecCtx->thread_type = FF_THREAD_FRAME;
+            } else
+            {
+                std::cerr << params.codec << " doesn't support slice threading, "
+                    "using its default" << std::endl;
+            }
+            break;
+
+        case ENCODER_THREADING_AUTO:
+            break;
+    }
+
+    videoCodecCtx->thread_count = threads;
+    if (params.encoder_slices > 0)
+        videoCodecCtx->slices = params.encoder_slices;
+
+    std::cout << "Encoder threads: " << threads << std::endl;
+}
+
 void FrameWriter::init_video_stream()
 {
     AVDictionary *options = NULL;
@@ -107,32 +414,56 @@ void FrameWriter::init_video_stream()
         std::exit(-1);
     }
 
-    videoStream = avformat_new_stream(fmtCtx, codec);
+    videoStream = avformat_new_stream(fmtCtx, NULL);
     if (!videoStream)
     {
         std::cerr << "Failed to open stream" << std::endl;
         std::exit(-1);
     }
 
-    videoCodecCtx = videoStream->codec;
+    videoCodecCtx = avcodec_alloc_context3(codec);
+    if (!videoCodecCtx)
+    {
+        std::cerr << "Failed to allocate codec context" << std::endl;
+        std::exit(-1);
+    }
     videoCodecCtx->width = params.width;
     videoCodecCtx->height = params.height;
-    videoCodecCtx->time_base = (AVRational){ 1, FPS };
+    videoCodecCtx->time_base = VIDEO_TIME_BASE;
+    if (params.framerate > 0)
+        videoCodecCtx->framerate = (AVRational){ params.framerate, 1 };
 
-    if (params.codec.find("vaapi") != std::string::npos)
+    hw_backend = find_hw_backend(params.codec);
+    conversion_format = get_codec_pix_fmt(codec);
+    if (hw_backend)
     {
-        videoCodecCtx->pix_fmt = AV_PIX_FMT_VAAPI;
+        videoCodecCtx->pix_fmt = hw_backend->hw_format;
         init_hw_accel();
         videoCodecCtx->hw_frames_ctx = av_buffer_ref(hw_frame_context);
+
+        /* Renditions upload the scaled YUV frames */
+        if (params.scale_source_format != AV_PIX_FMT_NONE)
+        {
+            conversion_format = hw_backend->sw_format;
+            if (conversion_format == AV_PIX_FMT_NONE)
+            {
+                std::cerr << params.codec << " can't be used for renditions" << std::endl;
+                std::exit(-1);
+            }
+        }
     } else
     {
-        videoCodecCtx->pix_fmt = PIX_FMT;
-        init_sws();
+        videoCodecCtx->pix_fmt = conversion_format;
     }
 
+    if (conversion_format != AV_PIX_FMT_NONE && !params.dmabuf)
+        init_sws();
+
     if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
         videoCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
+    init_encoder_threading(codec);
+
     int err;
     if ((err = avcodec_open2(videoCodecCtx, codec, &options)) < 0)
     {
@@ -140,7 +471,8 @@ void FrameWriter::init_video_stream()
         std::exit(-1);
     }
     av_dict_free(&options);
-    videoStream->time_base = (AVRational){ 1, FPS };
+    avcodec_parameters_from_context(videoStream->codecpar, videoCodecCtx);
+    videoStream->time_base = VIDEO_TIME_BASE;
 }
 
 static uint64_t get_codec_channel_layout(AVCodec *codec)
@@ -173,7 +505,7 @@ static enum AVSampleFormat get_codec_sample_fmt(AVCodec *codec)
     return codec->sample_fmts[0];
 }
 
-void FrameWriter::init_audio_stream()
+void FrameWriter::init_audio_stream(AudioTrack& track)
 {
     AVCodec* codec = avcodec_find_encoder_by_name("aac");
     if (!codec)
@@ -182,93 +514,405 @@ void FrameWriter::init_audio_stream()
         std::exit(-1);
     }
 
-    audioStream = avformat_new_stream(fmtCtx, codec);
-    if (!audioStream)
+    track.stream = avformat_new_stream(fmtCtx, NULL);
+    if (!track.stream)
     {
         std::cerr << "Failed to open audio stream" << std::endl;
         std::exit(-1);
     }
 
-    audioCodecCtx = audioStream->codec;
-    audioCodecCtx->bit_rate = lrintf(128000.0f);
-    audioCodecCtx->sample_fmt = get_codec_sample_fmt(codec);
-    audioCodecCtx->channel_layout = get_codec_channel_layout(codec);
-    audioCodecCtx->sample_rate = AUDIO_RATE;
-    audioCodecCtx->time_base = (AVRational) { 1, 1000 };
-    audioCodecCtx->channels = av_get_channel_layout_nb_channels(audioCodecCtx->channel_layout);
+    track.codec_ctx = avcodec_alloc_context3(codec);
+    if (!track.codec_ctx)
+    {
+        std::cerr << "Failed to allocate audio codec context" << std::endl;
+        std::exit(-1);
+    }
+    track.codec_ctx->bit_rate = lrintf(128000.0f);
+    track.codec_ctx->sample_fmt = get_codec_sample_fmt(codec);
+    track.codec_ctx->channel_layout = get_codec_channel_layout(codec);
+    track.codec_ctx->sample_rate = AUDIO_RATE;
+    track.codec_ctx->time_base = (AVRational) { 1, 1000 };
+    track.codec_ctx->channels = av_get_channel_layout_nb_channels(track.codec_ctx->channel_layout);
 
     if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
-        audioCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        track.codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     int err;
-    if ((err = avcodec_open2(audioCodecCtx, codec, NULL)) < 0)
+    if ((err = avcodec_open2(track.codec_ctx, codec, NULL)) < 0)
     {
         std::cerr << "(audio) avcodec_open2 failed " << err << std::endl;
         std::exit(-1);
     }
+    avcodec_parameters_from_context(track.stream->codecpar, track.codec_ctx);
+    track.stream->time_base = track.codec_ctx->time_base;
 
-    swrCtx = swr_alloc();
-    if (!swrCtx)
+    track.swr_ctx = swr_alloc();
+    if (!track.swr_ctx)
     {
         std::cerr << "Faild to allocate swr context" << std::endl;
         std::exit(-1);
     }
 
-    av_opt_set_int(swrCtx, "in_sample_rate", AUDIO_RATE, 0);
-    av_opt_set_int(swrCtx, "out_sample_rate", audioCodecCtx->sample_rate, 0);
-    av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-    av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", audioCodecCtx->sample_fmt, 0);
-    av_opt_set_channel_layout(swrCtx, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-    av_opt_set_channel_layout(swrCtx, "out_channel_layout", audioCodecCtx->channel_layout, 0);
+    av_opt_set_int(track.swr_ctx, "in_sample_rate", AUDIO_RATE, 0);
+    av_opt_set_int(track.swr_ctx, "out_sample_rate", track.codec_ctx->sample_rate, 0);
+    av_opt_set_sample_fmt(track.swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    av_opt_set_sample_fmt(track.swr_ctx, "out_sample_fmt", track.codec_ctx->sample_fmt, 0);
+    av_opt_set_channel_layout(track.swr_ctx, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_channel_layout(track.swr_ctx, "out_channel_layout", track.codec_ctx->channel_layout, 0);
 
-    if (swr_init(swrCtx))
+    if (swr_init(track.swr_ctx))
     {
         std::cerr << "Failed to initialize swr" << std::endl;
         std::exit(-1);
     }
+
+    track.input_frame = alloc_audio_frame(AV_SAMPLE_FMT_FLT,
+        AV_CH_LAYOUT_STEREO, AUDIO_RATE, track.codec_ctx->frame_size);
+    track.output_frame = alloc_audio_frame(track.codec_ctx->sample_fmt,
+        track.codec_ctx->channel_layout, track.codec_ctx->sample_rate,
+        track.codec_ctx->frame_size);
+}
+
+AVFrame *FrameWriter::alloc_audio_frame(AVSampleFormat format,
+    uint64_t channel_layout, int sample_rate, int nb_samples)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+    {
+        std::cerr << "Failed to allocate audio frame" << std::endl;
+        std::exit(-1);
+    }
+
+    frame->format         = format;
+    frame->channel_layout = channel_layout;
+    frame->sample_rate    = sample_rate;
+    frame->nb_samples     = nb_samples;
+
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+        std::cerr << "Failed to allocate audio frame buffer" << std::endl;
+        std::exit(-1);
+    }
+
+    return frame;
 }
 
 void FrameWriter::init_codecs()
 {
     init_video_stream();
     if (params.enable_audio)
-        init_audio_stream();
+    {
+        audio_tracks.resize(params.audio_tracks);
+        for (auto& track : audio_tracks)
+            init_audio_stream(track);
+    }
 
     av_dump_format(fmtCtx, 0, params.file.c_str(), 1);
-    if (avio_open(&fmtCtx->pb, params.file.c_str(), AVIO_FLAG_WRITE))
+    open_segment();
+
+    /* The renditions copy the queue size, so they share the budget too */
+    if (params.memory_budget)
+    {
+        size_t available = params.memory_budget > hw_pool_bytes ?
+            params.memory_budget - hw_pool_bytes : 0;
+        size_t queue_size = available / (1 + params.renditions.size());
+        params.muxer_queue_size = std::max<size_t>(MIN_MUXER_QUEUE_SIZE,
+            std::min(params.muxer_queue_size, queue_size));
+    }
+
+    if (params.stats)
+        params.stats->muxer_queue.set_limit(params.muxer_queue_size);
+
+    packet_queue = std::unique_ptr<PacketQueue> (
+        new PacketQueue(params.muxer_queue_size));
+    muxer_thread = std::thread([=] () { muxer_loop(); });
+}
+
+std::string FrameWriter::get_output_file_name(int segment)
+{
+    if (!params.segment_usec && !params.segment_size)
+        return params.file;
+
+    /* recording.mp4 -> recording-0001.mp4 */
+    char number[16];
+    snprintf(number, sizeof(number), "-%04d", segment);
+
+    size_t dot = params.file.find_last_of('.');
+    size_t slash = params.file.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return params.file + number;
+
+    return params.file.substr(0, dot) + number + params.file.substr(dot);
+}
+
+/* Open the next output file, with the same streams as fmtCtx */
+void FrameWriter::open_segment()
+{
+    std::string file = get_output_file_name(nr_segments + 1);
+    if (avformat_alloc_output_context2(&muxCtx, outputFmt, NULL, file.c_str()) < 0)
+    {
+        std::cerr << "Failed to allocate output context" << std::endl;
+        std::exit(-1);
+    }
+
+    for (unsigned i = 0; i < fmtCtx->nb_streams; i++)
+    {
+        AVStream *stream = avformat_new_stream(muxCtx, NULL);
+        if (!stream)
+        {
+            std::cerr << "Failed to open stream" << std::endl;
+            std::exit(-1);
+        }
+
+        avcodec_parameters_copy(stream->codecpar, fmtCtx->streams[i]->codecpar);
+        stream->time_base = fmtCtx->streams[i]->time_base;
+    }
+
+    AVDictionary *io_options = NULL;
+    if (params.streaming)
+    {
+        /* Don't let the muxer hold back packets, and give up on a stalled
+         * connection instead of hanging the muxer thread forever */
+        muxCtx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        muxCtx->max_delay = 0;
+        av_dict_set(&io_options, "rw_timeout", STREAM_IO_TIMEOUT, 0);
+    }
+
+    int ret = 0;
+    if (!(outputFmt->flags & AVFMT_NOFILE))
+        ret = avio_open2(&muxCtx->pb, file.c_str(), AVIO_FLAG_WRITE, NULL, &io_options);
+    av_dict_free(&io_options);
+
+    if (ret < 0)
     {
         std::cerr << "avio_open failed" << std::endl;
         std::exit(-1);
     }
 
     AVDictionary *dummy = NULL;
-    if (avformat_write_header(fmtCtx, &dummy) != 0)
+    if (avformat_write_header(muxCtx, &dummy) != 0)
     {
         std::cerr << "Failed to write file header" << std::endl;
         std::exit(-1);
     }
     av_dict_free(&dummy);
+
+    segment_start_usec = AV_NOPTS_VALUE;
+    segment_bytes = 0;
+    ++nr_segments;
+
+    /* Rolling mode: drop the oldest segment */
+    segment_files.push_back(file);
+    if (params.segment_keep > 0 && (int)segment_files.size() > params.segment_keep)
+    {
+        unlink(segment_files.front().c_str());
+        segment_files.pop_front();
+    }
+}
+
+void FrameWriter::close_segment()
+{
+    // Writing the end of the file.
+    av_write_trailer(muxCtx);
+
+    // Closing the file.
+    if (!(outputFmt->flags & AVFMT_NOFILE))
+        avio_closep(&muxCtx->pb);
+
+    avformat_free_context(muxCtx);
+    muxCtx = NULL;
+}
+
+/* Segments are cut only before video keyframes, so that each of them can be
+ * played back on its own */
+bool FrameWriter::is_segment_due(AVPacket *pkt)
+{
+    if (pkt->stream_index != videoStream->index || !(pkt->flags & AV_PKT_FLAG_KEY))
+        return false;
+
+    int64_t usec = av_rescale_q(pkt->pts, videoStream->time_base, VIDEO_TIME_BASE);
+    if (segment_start_usec == AV_NOPTS_VALUE)
+    {
+        segment_start_usec = usec;
+        return false;
+    }
+
+    return (params.segment_usec && usec - segment_start_usec >= params.segment_usec) ||
+        (params.segment_size && segment_bytes >= params.segment_size);
+}
+
+/* Make the encoder start a new GOP where the next segment should begin,
+ * instead of waiting for its own next keyframe */
+void FrameWriter::force_segment_keyframe(AVFrame *frame)
+{
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    if (params.segment_usec && frame->pts >= next_keyframe_usec)
+    {
+        if (next_keyframe_usec > 0)
+            frame->pict_type = AV_PICTURE_TYPE_I;
+        next_keyframe_usec = frame->pts + params.segment_usec;
+    }
+
+    int segment = nr_segments;
+    if (params.segment_size && size_keyframe_segment != segment &&
+        segment_bytes >= params.segment_size)
+    {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        size_keyframe_segment = segment;
+    }
 }
 
 void FrameWriter::init_sws()
 {
+    /* Renditions scale the converted frames, their format is the same */
+    if (params.scale_source_format != AV_PIX_FMT_NONE)
+    {
+        scale_ctx = sws_getContext(params.scale_source_width,
+            params.scale_source_height, params.scale_source_format,
+            params.width, params.height, conversion_format, SWS_BILINEAR,
+            NULL, NULL, NULL);
+        if (!scale_ctx)
+        {
+            std::cerr << "Failed to create sws context" << std::endl;
+            std::exit(-1);
+        }
+
+        return;
+    }
+
+    AVPixelFormat input_fmt = AV_PIX_FMT_BGR0;
     switch (params.format)
     {
         case INPUT_FORMAT_BGR0:
-            swsCtx = sws_getContext(params.width, params.height, AV_PIX_FMT_BGR0,
-                params.width, params.height, PIX_FMT, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+            input_fmt = AV_PIX_FMT_BGR0;
             break;
         case INPUT_FORMAT_RGB0:
-            swsCtx = sws_getContext(params.width, params.height, AV_PIX_FMT_RGB0,
-                params.width, params.height, PIX_FMT, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+            input_fmt = AV_PIX_FMT_RGB0;
             break;
     }
 
-    if (!swsCtx)
+    if (conversion_format == PIX_FMT)
+        simd_converter = find_yuv420p_converter();
+    if (simd_converter)
+        std::cout << "Using SIMD colorspace conversion" << std::endl;
+
+    /* Split the frame into horizontal slices, one per thread. Each slice
+     * starts on an even row, so that it also starts a new row of the
+     * vertically subsampled chroma planes */
+    int nr_slices = std::max(1, std::min(params.conversion_threads,
+        params.height / 2));
+    int slice_height = (params.height / nr_slices) & ~1;
+
+    for (int i = 0; i < nr_slices; i++)
     {
-        std::cerr << "Failed to create sws context" << std::endl;
+        ConversionSlice slice;
+        slice.y = i * slice_height;
+        slice.height = (i == nr_slices - 1) ?
+            params.height - slice.y : slice_height;
+
+        if (!simd_converter)
+        {
+            slice.ctx = sws_getContext(params.width, slice.height, input_fmt,
+                params.width, slice.height, conversion_format, SWS_FAST_BILINEAR,
+                NULL, NULL, NULL);
+            if (!slice.ctx)
+            {
+                std::cerr << "Failed to create sws context" << std::endl;
+                std::exit(-1);
+            }
+        }
+
+        conversion_slices.push_back(slice);
+    }
+
+    /* The encoder thread converts the last slice itself */
+    if (params.conversion_pool)
+        conversion_pool = params.conversion_pool;
+    else if (nr_slices > 1)
+        conversion_pool = std::make_shared<ThreadPool>(nr_slices - 1);
+}
+
+/* Convert the rows [first_row, last_row) of the slice. sws contexts can
+ * only convert whole slices and ignore the row range. */
+void FrameWriter::convert_slice(const ConversionSlice& slice,
+    const uint8_t *pixels, int stride, int first_row, int last_row)
+{
+    int y = slice.y, height = slice.height;
+    if (simd_converter)
+    {
+        y = std::max(y, first_row);
+        height = std::min(slice.y + slice.height, last_row) - y;
+        if (height <= 0)
+            return;
+    }
+
+    const uint8_t *src = pixels + y * stride;
+
+    uint8_t *dst[AV_NUM_DATA_POINTERS] = {NULL};
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && encoder_frame->data[i]; i++)
+    {
+        /* Planes after the first one are the chroma planes,
+         * which have half the height */
+        int plane_y = (i == 0) ? y : y / 2;
+        dst[i] = encoder_frame->data[i] + plane_y * encoder_frame->linesize[i];
+    }
+
+    if (simd_converter)
+    {
+        simd_converter(src, stride, params.width, height, dst,
+            encoder_frame->linesize, params.format == INPUT_FORMAT_BGR0);
+    } else
+    {
+        sws_scale(slice.ctx, &src, &stride, 0, height,
+            dst, encoder_frame->linesize);
+    }
+}
+
+void FrameWriter::convert_frame(const uint8_t *pixels, int stride)
+{
+    /* Frame-threaded encoders may still reference the previous frame. Then
+     * this copies it into a new buffer, which keeps the undamaged rows. */
+    if (av_frame_make_writable(encoder_frame) < 0)
+    {
+        std::cerr << "Failed to allocate frame buffer" << std::endl;
         std::exit(-1);
     }
+
+    /* The rest of encoder_frame still contains the previous frame, so only
+     * the damaged rows need to be converted again */
+    int first_row = 0, last_row = params.height;
+    if (converted_first_frame && !frame_damage.empty())
+    {
+        first_row = params.height;
+        last_row = 0;
+        for (auto& box : frame_damage)
+        {
+            first_row = std::min(first_row, box.y);
+            last_row = std::max(last_row, box.y + box.height);
+        }
+
+        /* Keep whole 2x2 chroma blocks */
+        first_row &= ~1;
+        last_row = std::min(params.height, (last_row + 1) & ~1);
+    }
+
+    converted_first_frame = true;
+    if (!conversion_pool)
+    {
+        convert_slice(conversion_slices[0], pixels, stride, first_row, last_row);
+        return;
+    }
+
+    std::vector<std::function<void()>> batch;
+    for (auto& slice : conversion_slices)
+    {
+        batch.push_back([=, &slice] () {
+            convert_slice(slice, pixels, stride, first_row, last_row);
+        });
+    }
+
+    conversion_pool->run_all(batch);
 }
 
 FrameWriter::FrameWriter(const FrameWriterParams& _params) :
@@ -277,16 +921,24 @@ FrameWriter::FrameWriter(const FrameWriterParams& _params) :
     if (params.enable_ffmpeg_debug_output)
         av_log_set_level(AV_LOG_DEBUG);
 
+    /* The encoder's and the conversion threads inherit the mask */
+    if (!params.encoder_cpus.empty() && !set_thread_affinity(params.encoder_cpus))
+        std::cerr << "Failed to set the CPU affinity of the encoder" << std::endl;
+
     // Preparing the data concerning the format and codec,
     // in order to write properly the header, frame data and end of file.
-    this->outputFmt = av_guess_format(NULL, params.file.c_str(), NULL);
+    if (params.streaming)
+        avformat_network_init();
+
+    this->outputFmt = av_guess_format(
+        params.muxer.empty() ? NULL : params.muxer.c_str(), params.file.c_str(), NULL);
     if (!outputFmt)
     {
         std::cerr << "Failed to guess output format for file " << params.file << std::endl;
         std::exit(-1);
     }
 
-    if (avformat_alloc_output_context2(&this->fmtCtx, NULL, NULL, params.file.c_str()) < 0)
+    if (avformat_alloc_output_context2(&this->fmtCtx, outputFmt, NULL, params.file.c_str()) < 0)
     {
         std::cerr << "Failed to allocate output context" << std::endl;
         std::exit(-1);
@@ -294,13 +946,17 @@ FrameWriter::FrameWriter(const FrameWriterParams& _params) :
 
     init_codecs();
 
+    /* dmabuf frames go through the filter graph instead */
+    if (params.dmabuf)
+        return;
+
     // Allocating memory for each conversion output YUV frame.
     encoder_frame = av_frame_alloc();
-    if (hw_device_context) {
+    if (conversion_format == AV_PIX_FMT_NONE) {
         encoder_frame->format = params.format == INPUT_FORMAT_RGB0 ?
             AV_PIX_FMT_RGB0 : AV_PIX_FMT_BGR0;
     } else {
-        encoder_frame->format = PIX_FMT;
+        encoder_frame->format = conversion_format;
     }
     encoder_frame->width = params.width;
     encoder_frame->height = params.height;
@@ -311,195 +967,590 @@ FrameWriter::FrameWriter(const FrameWriterParams& _params) :
     }
 
     if (hw_device_context)
-    {
         hw_frame = av_frame_alloc();
-        AVHWFramesContext *frctx = (AVHWFramesContext*)hw_frame_context->data;
-        hw_frame->format = frctx->format;
-        hw_frame->hw_frames_ctx = av_buffer_ref(hw_frame_context);
-        hw_frame->width = params.width;
-        hw_frame->height = params.height;
 
-        if (av_hwframe_get_buffer(hw_frame_context, hw_frame, 0))
+    init_renditions();
+}
+
+void FrameWriter::set_frame_damage(const std::vector<FrameDamage>& damage,
+    bool y_invert)
+{
+    frame_damage.clear();
+    for (auto box : damage)
+    {
+        /* Clip to the frame */
+        box.width = std::min(box.x + box.width, params.width) - std::max(box.x, 0);
+        box.height = std::min(box.y + box.height, params.height) - std::max(box.y, 0);
+        box.x = std::max(box.x, 0);
+        box.y = std::max(box.y, 0);
+        if (box.width <= 0 || box.height <= 0)
+            continue;
+
+        if (y_invert)
+            box.y = params.height - box.y - box.height;
+
+        frame_damage.push_back(box);
+    }
+}
+
+/* Undamaged regions get a higher quantizer, which makes the encoder skip
+ * their macroblocks. Keyframes have to encode everything properly, since
+ * later frames copy the static regions from them. */
+void FrameWriter::add_damage_hints(AVFrame *frame)
+{
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 25, 100)
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (!params.damage_hints || frame_damage.empty() ||
+        frame->pict_type == AV_PICTURE_TYPE_I)
+    {
+        return;
+    }
+
+    /* The first region containing a macroblock wins, so the damage comes
+     * before the rest of the frame */
+    size_t nr_regions = frame_damage.size() + 1;
+    AVFrameSideData *side_data = av_frame_new_side_data(frame,
+        AV_FRAME_DATA_REGIONS_OF_INTEREST, nr_regions * sizeof(AVRegionOfInterest));
+    if (!side_data)
+        return;
+
+    AVRegionOfInterest *roi = (AVRegionOfInterest*)side_data->data;
+    for (size_t i = 0; i < nr_regions; i++)
+    {
+        roi[i].self_size = sizeof(AVRegionOfInterest);
+        if (i < frame_damage.size())
         {
-            std::cerr << "failed to hw frame buffer" << std::endl;
-            std::exit(-1);
+            auto& box = frame_damage[i];
+            roi[i].top = box.y;
+            roi[i].bottom = box.y + box.height;
+            roi[i].left = box.x;
+            roi[i].right = box.x + box.width;
+            roi[i].qoffset = (AVRational){ 0, 1 };
+        } else
+        {
+            roi[i].top = 0;
+            roi[i].bottom = params.height;
+            roi[i].left = 0;
+            roi[i].right = params.width;
+            roi[i].qoffset = DAMAGE_HINT_QOFFSET;
         }
     }
+#else
+    (void)frame;
+#endif
 }
 
-void FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
+void FrameWriter::add_frame(const FrameShm& frame, int64_t usec, bool y_invert,
+    const std::vector<FrameDamage>& damage)
 {
-    /* Calculate data after y-inversion */
-    int stride[] = {int(4 * params.width)};
-    const uint8_t *formatted_pixels = pixels;
+    if (frame.format != params.format || frame.width != params.width ||
+        frame.height != params.height || frame.stride < 4 * frame.width)
+    {
+        if (!warned_layout_change)
+        {
+            std::cerr << "Frame layout doesn't match the encoder, dropping frames" << std::endl;
+            warned_layout_change = true;
+        }
+
+        return;
+    }
+
+    set_frame_damage(damage, y_invert);
+
+    /* Calculate data after y-inversion. The compositor's stride is used
+     * as-is, so padded rows don't need to be realigned. */
+    int stride[] = {frame.stride};
+    const uint8_t *formatted_pixels = frame.pixels;
     if (y_invert)
     {
         formatted_pixels += stride[0] * (params.height - 1);
         stride[0] *= -1;
     }
 
-    AVFrame **output_frame;
-    if (hw_device_context)
+    /* Renditions may still be scaling the previous frame */
+    for (auto& rendition : renditions)
+        rendition->wait_source_released();
+
+    auto convert_start = std::chrono::steady_clock::now();
+    if (conversion_format == AV_PIX_FMT_NONE)
     {
         encoder_frame->data[0] = (uint8_t*)formatted_pixels;
         encoder_frame->linesize[0] = stride[0];
+    } else
+    {
+        convert_frame(formatted_pixels, stride[0]);
+    }
 
-        if (av_hwframe_transfer_data(hw_frame, encoder_frame, 0))
-        {
-            std::cerr << "Failed to upload data to the gpu!" << std::endl;
-            return;
-        }
+    AVFrame *output_frame = upload_frame();
+    if (!output_frame)
+        return;
 
-        output_frame = &hw_frame;
-    } else
+    if (params.stats)
+        params.stats->convert.record_since(convert_start);
+
+    for (auto& rendition : renditions)
+        rendition->add_frame(encoder_frame, usec);
+
+    output_frame->pts = usec;
+    encode_video_frame(output_frame);
+}
+
+/* Returns the frame to encode, which is a hw surface with the contents of
+ * encoder_frame for hardware encoders */
+AVFrame *FrameWriter::upload_frame()
+{
+    if (!hw_device_context)
+        return encoder_frame;
+
+    /* The encoder keeps its own reference to the surface of the previous
+     * frame until it is done with it */
+    av_frame_unref(hw_frame);
+    if (av_hwframe_get_buffer(hw_frame_context, hw_frame, 0))
+    {
+        std::cerr << "Failed to get a hw surface" << std::endl;
+        return NULL;
+    }
+
+    if (av_hwframe_transfer_data(hw_frame, encoder_frame, 0))
     {
-        sws_scale(swsCtx, &formatted_pixels, stride, 0, params.height,
-            encoder_frame->data, encoder_frame->linesize);
+        std::cerr << "Failed to upload data to the gpu!" << std::endl;
+        return NULL;
+    }
 
-        output_frame = &encoder_frame;
+    return hw_frame;
+}
+
+void FrameWriter::scale_frame(const AVFrame *source)
+{
+    /* The encoder may still reference the previous frame */
+    if (av_frame_make_writable(encoder_frame) < 0)
+    {
+        std::cerr << "Failed to allocate frame buffer" << std::endl;
+        std::exit(-1);
     }
 
-    (*output_frame)->pts = usec;
+    sws_scale(scale_ctx, source->data, source->linesize, 0,
+        params.scale_source_height, encoder_frame->data, encoder_frame->linesize);
+}
+
+void FrameWriter::encode_scaled_frame(int64_t usec)
+{
+    AVFrame *output_frame = upload_frame();
+    if (!output_frame)
+        return;
+
+    output_frame->pts = usec;
+    encode_video_frame(output_frame);
+}
 
-    AVPacket pkt;
-    av_init_packet(&pkt);
-    pkt.data = NULL;
-    pkt.size = 0;
+/* Each rendition gets the settings of this FrameWriter, except for its
+ * size, codec and file */
+void FrameWriter::init_renditions()
+{
+    if (params.renditions.empty())
+        return;
 
-    int got_output;
-    avcodec_encode_video2(videoCodecCtx, &pkt, *output_frame, &got_output);
-    if (got_output)
-      finish_frame(pkt, true);
+    if (conversion_format == AV_PIX_FMT_NONE)
+    {
+        std::cerr << "Renditions need frames converted on the CPU, "
+            "not recording them with " << params.codec << std::endl;
+        return;
+    }
+
+    for (auto& rendition : params.renditions)
+    {
+        FrameWriterParams rendition_params = params;
+        rendition_params.file = rendition.file;
+        rendition_params.width = rendition.width;
+        rendition_params.height = rendition.height;
+        rendition_params.codec = rendition.codec;
+        rendition_params.codec_options = rendition.codec_options;
+        rendition_params.enable_audio = false;
+        rendition_params.damage_hints = false;
+        rendition_params.renditions.clear();
+        rendition_params.scale_source_format = conversion_format;
+        rendition_params.scale_source_width = params.width;
+        rendition_params.scale_source_height = params.height;
+        rendition_params.stats = NULL;
+        /* Already split by this FrameWriter */
+        rendition_params.memory_budget = 0;
+
+        renditions.emplace_back(new Rendition(rendition_params));
+    }
 }
 
-#define SRC_RATE 1e6
-#define DST_RATE 1e3
+void FrameWriter::add_dmabuf_frame(const FrameDmabuf& dmabuf, int64_t usec)
+{
+    AVDRMFrameDescriptor *desc =
+        (AVDRMFrameDescriptor*)av_mallocz(sizeof(AVDRMFrameDescriptor));
+    desc->nb_objects = 1;
+    desc->objects[0].fd = dmabuf.fd;
+    desc->objects[0].format_modifier = dmabuf.modifier;
+    desc->objects[0].size = dmabuf.size;
+
+    desc->nb_layers = 1;
+    desc->layers[0].format = dmabuf.format;
+    desc->layers[0].nb_planes = dmabuf.nr_planes;
+    for (int i = 0; i < dmabuf.nr_planes; i++)
+    {
+        desc->layers[0].planes[i].object_index = 0;
+        desc->layers[0].planes[i].offset = dmabuf.offset[i];
+        desc->layers[0].planes[i].pitch = dmabuf.stride[i];
+    }
 
-static int64_t conv_audio_pts(SwrContext *ctx, int64_t in)
+    AVFrame *frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_DRM_PRIME;
+    frame->width = params.width;
+    frame->height = params.height;
+    frame->data[0] = (uint8_t*)desc;
+    frame->buf[0] = av_buffer_create((uint8_t*)desc, sizeof(*desc),
+        av_buffer_default_free, NULL, 0);
+    frame->hw_frames_ctx = av_buffer_ref(drm_frame_context);
+    frame->pts = usec;
+
+    auto convert_start = std::chrono::steady_clock::now();
+    if (av_buffersrc_add_frame(dmabuf_src, frame) < 0)
+    {
+        std::cerr << "Failed to import dmabuf frame" << std::endl;
+        av_frame_free(&frame);
+        return;
+    }
+
+    if (params.stats)
+        params.stats->convert.record_since(convert_start);
+
+    /* The source frame was moved to the filter graph, so reuse it for the
+     * converted frames */
+    while (av_buffersink_get_frame(dmabuf_sink, frame) >= 0)
+    {
+        encode_video_frame(frame);
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+}
+
+/* Send a frame to the encoder, or flush it if frame is NULL, and collect
+ * all the packets it has ready. Encoders with lookahead or B-frames return
+ * none for a while, and then several at once. */
+void FrameWriter::encode_frame(AVCodecContext *ctx, AVFrame *frame,
+    std::vector<AVPacket*>& packets)
 {
-    int64_t d = (int64_t) AUDIO_RATE * AUDIO_RATE;
+    int ret = avcodec_send_frame(ctx, frame);
+    if (ret < 0 && ret != AVERROR_EOF)
+    {
+        std::cerr << "Failed to send a frame to the encoder " << ret << std::endl;
+        return;
+    }
 
-    /* Convert from audio_src_tb to 1/(src_samplerate * dst_samplerate) */
-    in = av_rescale_rnd(in, d, SRC_RATE, AV_ROUND_NEAR_INF);
+    while (true)
+    {
+        AVPacket *pkt = av_packet_alloc();
+        ret = avcodec_receive_packet(ctx, pkt);
+        if (ret < 0)
+        {
+            av_packet_free(&pkt);
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+                std::cerr << "Failed to encode a frame " << ret << std::endl;
+            return;
+        }
+
+        packets.push_back(pkt);
+    }
+}
 
-    /* In units of 1/(src_samplerate * dst_samplerate) */
-    in = swr_next_pts(ctx, in);
+void FrameWriter::force_keyframe()
+{
+    forced_keyframe = true;
+}
 
-    /* Convert from 1/(src_samplerate * dst_samplerate) to audio_dst_tb */
-    return av_rescale_rnd(in, DST_RATE, d, AV_ROUND_NEAR_INF);
+void FrameWriter::set_bitrate(int64_t bitrate)
+{
+    pending_bitrate = bitrate;
 }
 
-void FrameWriter::send_audio_pkt(AVFrame *frame)
+bool FrameWriter::set_crf(double crf)
 {
-    AVPacket pkt;
-    av_init_packet(&pkt);
-    pkt.data = NULL;
-    pkt.size = 0;
+    if (!av_opt_find(videoCodecCtx, "crf", NULL, 0, AV_OPT_SEARCH_CHILDREN))
+        return false;
 
-    int got_output;
-    avcodec_encode_audio2(audioCodecCtx, &pkt, frame, &got_output);
-    if (got_output)
-      finish_frame(pkt, false);
+    pending_crf = crf;
+    return true;
 }
 
-size_t FrameWriter::get_audio_buffer_size()
+void FrameWriter::apply_encoder_changes()
 {
-    return audioCodecCtx->frame_size << 3;
+    int64_t bitrate = pending_bitrate.exchange(0);
+    if (bitrate > 0)
+    {
+        videoCodecCtx->bit_rate = bitrate;
+        if (videoCodecCtx->rc_max_rate)
+            videoCodecCtx->rc_max_rate = bitrate;
+    }
+
+    double crf = pending_crf.exchange(-1);
+    if (crf >= 0)
+        av_opt_set_double(videoCodecCtx, "crf", crf, AV_OPT_SEARCH_CHILDREN);
 }
 
-void FrameWriter::add_audio(const void* buffer)
+void FrameWriter::encode_video_frame(AVFrame *frame)
 {
-    AVFrame *inputf = av_frame_alloc();
-    inputf->sample_rate    = AUDIO_RATE;
-    inputf->format         = AV_SAMPLE_FMT_FLT;
-    inputf->channel_layout = AV_CH_LAYOUT_STEREO;
-    inputf->nb_samples     = audioCodecCtx->frame_size;
+    if (frame)
+    {
+        apply_encoder_changes();
+        force_segment_keyframe(frame);
+        if (keyframe_requested || forced_keyframe.exchange(false))
+        {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            keyframe_requested = false;
+        }
+
+        add_damage_hints(frame);
+    }
 
-    av_frame_get_buffer(inputf, 0);
-    memcpy(inputf->data[0], buffer, get_audio_buffer_size());
+    /* The packets are queued only afterwards, so that waiting for the
+     * muxer isn't counted as encoding time */
+    std::vector<AVPacket*> packets;
+    auto encode_start = std::chrono::steady_clock::now();
+    encode_frame(videoCodecCtx, frame, packets);
+    if (params.stats)
+        params.stats->encode.record_since(encode_start);
 
-    AVFrame *outputf = av_frame_alloc();
-    outputf->format         = audioCodecCtx->sample_fmt;
-    outputf->sample_rate    = audioCodecCtx->sample_rate;
-    outputf->channel_layout = audioCodecCtx->channel_layout;
-    outputf->nb_samples     = audioCodecCtx->frame_size;
-    av_frame_get_buffer(outputf, 0);
+    for (auto pkt : packets)
+        finish_frame(pkt, videoCodecCtx, videoStream);
+}
 
-    outputf->pts = conv_audio_pts(swrCtx, INT64_MIN);
-    swr_convert_frame(swrCtx, outputf, inputf);
+/* How far the audio pts may lag behind the capture timestamps before they
+ * jump forward to them, e.g after a gap in the capture. They never jump back,
+ * since the pts have to be increasing. */
+#define AUDIO_RESYNC_USEC 100000
+/* Otherwise, the pts are pulled towards the capture timestamps by at most
+ * 1/AUDIO_SLEW_DIVISOR of a frame, so that the jitter of the timestamps
+ * doesn't make frames overlap */
+#define AUDIO_SLEW_DIVISOR 100
 
-    send_audio_pkt(outputf);
+void FrameWriter::send_audio_pkt(AudioTrack& track, AVFrame *frame)
+{
+    std::vector<AVPacket*> packets;
+    encode_frame(track.codec_ctx, frame, packets);
+    for (auto pkt : packets)
+        finish_frame(pkt, track.codec_ctx, track.stream);
+}
 
-    av_frame_free(&inputf);
-    av_frame_free(&outputf);
+size_t FrameWriter::get_audio_buffer_size()
+{
+    return audio_tracks[0].codec_ctx->frame_size << 3;
 }
 
-void FrameWriter::finish_frame(AVPacket& pkt, bool is_video)
+void *FrameWriter::get_audio_buffer(size_t track)
 {
-    static std::mutex fmt_mutex, pending_mutex;
+    return audio_tracks[track].input_frame->data[0];
+}
 
-    if (is_video)
+void FrameWriter::add_audio(size_t track_index, int64_t usec)
+{
+    auto& track = audio_tracks[track_index];
+
+    /* The encoder may still hold a reference to the previous samples, in
+     * which case this gives us a fresh buffer instead of overwriting them.
+     * swr_convert_frame() shrinks nb_samples to what it produced, so reset
+     * it to the capacity first. */
+    track.output_frame->nb_samples = track.codec_ctx->frame_size;
+    av_frame_make_writable(track.output_frame);
+
+    int64_t frame_usec = track.codec_ctx->frame_size * 1000000ll / AUDIO_RATE;
+    int64_t error = track.next_usec == AV_NOPTS_VALUE ? INT64_MAX :
+        usec - track.next_usec;
+    if (error > AUDIO_RESYNC_USEC)
     {
-        av_packet_rescale_ts(&pkt, (AVRational){ 1, 1000000 }, videoStream->time_base);
-        pkt.stream_index = videoStream->index;
+        track.next_usec = std::max(usec, (int64_t)0);
     } else
     {
-        av_packet_rescale_ts(&pkt, (AVRational){ 1, 1000 }, audioStream->time_base);
-        pkt.stream_index = audioStream->index;
+        int64_t max_slew = frame_usec / AUDIO_SLEW_DIVISOR;
+        track.next_usec += std::min(std::max(error, -max_slew), max_slew);
     }
 
-    /* We use two locks to ensure that if WLOG the audio thread is waiting for
-     * the video one, when the video becomes ready the audio thread will be the
-     * next one to obtain the lock */
-    if (params.enable_audio)
+    /* The audio time base is in milliseconds */
+    track.output_frame->pts = track.next_usec / 1000;
+    track.next_usec += frame_usec;
+
+    swr_convert_frame(track.swr_ctx, track.output_frame, track.input_frame);
+
+    send_audio_pkt(track, track.output_frame);
+}
+
+void FrameWriter::finish_frame(AVPacket *pkt, AVCodecContext *ctx, AVStream *stream)
+{
+    av_packet_rescale_ts(pkt, ctx->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    queue_packet(pkt, stream == videoStream);
+
+    if (params.stats)
+        params.stats->muxer_queue.set_used(packet_queue->get_queued_bytes());
+}
+
+void FrameWriter::queue_packet(AVPacket *pkt, bool is_video)
+{
+    if (!params.streaming)
     {
-        pending_mutex.lock();
-        fmt_mutex.lock();
-        pending_mutex.unlock();
+        packet_queue->push(pkt);
+        return;
     }
 
-    av_interleaved_write_frame(fmtCtx, &pkt);
-    av_packet_unref(&pkt);
+    if (is_video && drop_until_keyframe)
+    {
+        if (pkt->flags & AV_PKT_FLAG_KEY)
+            drop_until_keyframe = false;
+        else
+            keyframe_requested = true;
+    }
 
-    if (params.enable_audio)
-        fmt_mutex.unlock();
+    if ((is_video && drop_until_keyframe) || !packet_queue->try_push(pkt))
+    {
+        if (is_video)
+        {
+            drop_until_keyframe = true;
+            keyframe_requested = true;
+        }
+
+        av_packet_free(&pkt);
+        ++dropped_packets;
+    }
 }
 
-FrameWriter::~FrameWriter()
+void FrameWriter::muxer_loop()
 {
-    // Writing the delayed frames:
-    AVPacket pkt;
-    av_init_packet(&pkt);
+    while (AVPacket *pkt = packet_queue->pop())
+    {
+        if (params.stats)
+            params.stats->muxer_queue.set_used(packet_queue->get_queued_bytes());
+
+        if ((params.segment_usec || params.segment_size) && is_segment_due(pkt))
+        {
+            close_segment();
+            open_segment();
+        }
+
+        segment_bytes += pkt->size;
+        av_packet_rescale_ts(pkt, fmtCtx->streams[pkt->stream_index]->time_base,
+            muxCtx->streams[pkt->stream_index]->time_base);
 
-    for (int got_output = 1; got_output;)
+        auto start = std::chrono::steady_clock::now();
+        /* Interleaving waits for a packet of every stream, which only adds
+         * latency to a live stream */
+        int ret = params.streaming ? av_write_frame(muxCtx, pkt) :
+            av_interleaved_write_frame(muxCtx, pkt);
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        av_packet_free(&pkt);
+
+        if (ret < 0)
+        {
+            handle_write_error(ret);
+            continue;
+        }
+
+        ++written_packets;
+        total_write_usec += elapsed;
+        if (elapsed > max_write_usec)
+            max_write_usec = elapsed;
+
+        if (params.stats)
+            params.stats->mux.record(elapsed);
+    }
+}
+
+/* A stream may recover from a dropped peer or a timeout, so failed packets
+ * are only dropped. A file with a missing packet is broken. */
+void FrameWriter::handle_write_error(int err)
+{
+    if (failed_packets++ == 0)
     {
-        avcodec_encode_video2(videoCodecCtx, &pkt, NULL, &got_output);
-        if (got_output)
-            finish_frame(pkt, true);
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_make_error_string(error, sizeof(error), err);
+        std::cerr << "Failed to write a packet to " << params.file << ": " << error
+            << (params.streaming ? ", dropping it" : ", stopping the recording")
+            << std::endl;
     }
 
-    for (int got_output = 1; got_output && params.enable_audio;)
+    if (params.streaming)
     {
-        avcodec_encode_audio2(audioCodecCtx, &pkt, NULL, &got_output);
-        if (got_output)
-            finish_frame(pkt, false);
+        ++dropped_packets;
+        return;
     }
 
-    // Writing the end of the file.
-    av_write_trailer(fmtCtx);
+    if (failed_packets == 1 && params.on_write_error)
+        params.on_write_error();
+}
 
-    // Closing the file.
-    if (!(outputFmt->flags & AVFMT_NOFILE))
-        avio_closep(&fmtCtx->pb);
+MuxerStats FrameWriter::get_muxer_stats()
+{
+    MuxerStats stats;
+    stats.queued_packets = packet_queue->get_nr_packets();
+    stats.queued_bytes = packet_queue->get_queued_bytes();
+    stats.peak_queued_bytes = packet_queue->get_peak_bytes();
+    stats.written_packets = written_packets;
+    stats.total_write_usec = total_write_usec;
+    stats.max_write_usec = max_write_usec;
+    stats.dropped_packets = dropped_packets;
+    stats.failed_packets = failed_packets;
+
+    return stats;
+}
 
-    avcodec_close(videoStream->codec);
+FrameWriter::~FrameWriter()
+{
+    // Writing the delayed frames:
+    renditions.clear();
+    encode_video_frame(NULL);
+    for (auto& track : audio_tracks)
+        send_audio_pkt(track, NULL);
+
+    packet_queue->close();
+    muxer_thread.join();
+
+    auto stats = get_muxer_stats();
+    std::cerr << "Muxer: wrote " << stats.written_packets << " packets, "
+        << "peak queue " << stats.peak_queued_bytes / 1024 << " KiB, "
+        << "write latency avg "
+        << (stats.written_packets ? stats.total_write_usec / stats.written_packets : 0)
+        << "us max " << stats.max_write_usec << "us";
+    if (params.streaming)
+        std::cerr << ", dropped " << stats.dropped_packets << " packets";
+    if (stats.failed_packets)
+        std::cerr << ", " << stats.failed_packets << " failed";
+    std::cerr << std::endl;
+
+    close_segment();
+    if (nr_segments > 1)
+        std::cerr << "Wrote " << nr_segments << " segments" << std::endl;
+
+    avcodec_free_context(&videoCodecCtx);
     // Freeing all the allocated memory:
-    sws_freeContext(swsCtx);
+    conversion_pool = nullptr;
+    for (auto& slice : conversion_slices)
+    {
+        if (slice.ctx)
+            sws_freeContext(slice.ctx);
+    }
+    if (scale_ctx)
+        sws_freeContext(scale_ctx);
 
     av_frame_free(&encoder_frame);
-    if (params.enable_audio)
-        avcodec_close(audioStream->codec);
+    av_frame_free(&hw_frame);
+    for (auto& track : audio_tracks)
+    {
+        av_frame_free(&track.input_frame);
+        av_frame_free(&track.output_frame);
+        swr_free(&track.swr_ctx);
+        avcodec_free_context(&track.codec_ctx);
+    }
+
+    avfilter_graph_free(&dmabuf_graph);
+    av_buffer_unref(&drm_frame_context);
+    av_buffer_unref(&drm_device_context);
+    av_buffer_unref(&hw_frame_context);
+    av_buffer_unref(&hw_device_context);
 
-    // TODO: free all the hw accel
     avformat_free_context(fmtCtx);
 }
@@ -8,6 +8,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <functional>
+#include <deque>
+#include <memory>
+#include "thread-pool.hpp"
+#include "convert.hpp"
+#include "packet-queue.hpp"
+#include "pipeline-stats.hpp"
+#include <thread>
+#include <atomic>
 
 #define AUDIO_RATE 44100
 
@@ -21,6 +30,10 @@ extern "C"
     #include <libavformat/avformat.h>
     #include <libavutil/hwcontext.h>
     #include <libavutil/opt.h>
+    #include <libavutil/hwcontext_drm.h>
+    #include <libavfilter/avfilter.h>
+    #include <libavfilter/buffersrc.h>
+    #include <libavfilter/buffersink.h>
 }
 
 enum InputFormat
@@ -29,30 +42,184 @@ enum InputFormat
      INPUT_FORMAT_RGB0
 };
 
+/* How the encoder splits its work between threads */
+enum EncoderThreading
+{
+    /* Keep the codec's default */
+    ENCODER_THREADING_AUTO,
+    /* Several frames at once, better throughput but more delay */
+    ENCODER_THREADING_FRAME,
+    /* Several slices of the same frame, no added delay */
+    ENCODER_THREADING_SLICE,
+};
+
+/* A rectangle of the frame which changed since the previous frame,
+ * in the coordinates of the captured buffer */
+struct FrameDamage
+{
+    int x, y;
+    int width, height;
+};
+
+/* A frame captured into a wl_shm buffer, with the layout the compositor
+ * chose. Rows may be padded, so stride can be larger than 4 * width. */
+struct FrameShm
+{
+    const uint8_t *pixels;
+    InputFormat format;
+    int width, height;
+    int stride;
+};
+
+/* A frame captured into a linux-dmabuf buffer. The fd stays owned by the caller. */
+struct FrameDmabuf
+{
+    int fd;
+    uint32_t format; // DRM fourcc
+    uint64_t modifier;
+    size_t size;
+    int nr_planes;
+    uint32_t offset[AV_DRM_MAX_PLANES], stride[AV_DRM_MAX_PLANES];
+};
+
+/* An extra output of the same capture, see Rendition */
+struct RenditionParams
+{
+    std::string file;
+    int width, height;
+    std::string codec;
+    std::map<std::string, std::string> codec_options;
+};
+
 struct FrameWriterParams
 {
     std::string file;
+    /* Container format, guessed from the file name if empty */
+    std::string muxer;
+    /* file is a network URL. Packets are written as soon as they are
+     * encoded, and dropped if the muxer queue is full instead of blocking
+     * the encoder. */
+    bool streaming;
     int width;
     int height;
 
     InputFormat format;
 
+    /* Target framerate, 0 if capturing every frame of the compositor */
+    int framerate;
+
     std::string codec;
-    std::string hw_device; // used only if codec contains vaapi
+    std::string hw_device; // VAAPI render node, CUDA index or QSV device of a hw codec
+    bool dmabuf; // frames are added with add_dmabuf_frame(), needs vaapi
     std::map<std::string, std::string> codec_options;
 
     int64_t audio_sync_offset;
 
+    /* Number of threads used for the colorspace conversion */
+    int conversion_threads;
+    /* If set, the conversion slices run on this pool, which may be shared
+     * with other FrameWriters, instead of a pool of our own */
+    std::shared_ptr<ThreadPool> conversion_pool;
+
+    /* Threads of software encoders, 0 for one per core. Hardware encoders
+     * ignore it. */
+    int encoder_threads;
+    EncoderThreading encoder_threading;
+    /* Slices per frame, 0 for the codec's default */
+    int encoder_slices;
+    /* CPUs the encoder and conversion threads run on, empty for any */
+    std::vector<int> encoder_cpus;
+
+    /* Maximal size of the encoded packets waiting to be written */
+    size_t muxer_queue_size;
+    /* Bytes the surfaces of a fixed hw frame pool and the muxer queues may
+     * use together, 0 for no limit. Shrinks the pool and the queues, but
+     * not below what they need to work. */
+    size_t memory_budget;
+
+    /* Start a new file every segment_usec of video or every segment_size
+     * bytes of packets, 0 to disable. The file name gets the segment number
+     * appended. Only the muxer is reopened, the encoders are kept. */
+    int64_t segment_usec;
+    size_t segment_size;
+    /* Delete old segments so that only the last segment_keep are kept,
+     * 0 to keep all of them */
+    int segment_keep;
+
+    /* Tell the encoder which parts of the frame are damaged, so that it
+     * spends fewer bits on the rest */
+    bool damage_hints;
+
     bool enable_audio;
+    /* Number of audio streams, each encoded from its own add_audio() calls */
+    int audio_tracks;
     bool enable_ffmpeg_debug_output;
+
+    /* Scaled copies of the recording, each encoded into its own file */
+    std::vector<RenditionParams> renditions;
+    /* For the FrameWriter of a rendition: the format and size of the frames
+     * it scales from. AV_PIX_FMT_NONE for a FrameWriter of captured frames. */
+    AVPixelFormat scale_source_format;
+    int scale_source_width, scale_source_height;
+
+    /* Where the time spent converting, encoding and muxing is recorded.
+     * Can be NULL */
+    PipelineStats *stats;
+
+    /* Called from the muxer thread when a packet can't be written to a
+     * file, after which the recording is useless. Can be empty. */
+    std::function<void()> on_write_error;
 };
 
+/* A horizontal band of the frame, converted by its own sws context,
+ * or by the SIMD converter if there is one */
+struct ConversionSlice
+{
+    SwsContext *ctx = NULL;
+    int y, height;
+};
+
+struct MuxerStats
+{
+    size_t queued_packets;
+    size_t queued_bytes;
+    size_t peak_queued_bytes;
+
+    uint64_t written_packets;
+    /* Time spent in av_interleaved_write_frame */
+    uint64_t total_write_usec;
+    uint64_t max_write_usec;
+
+    /* Packets dropped because the queue was full or the write failed,
+     * only when streaming */
+    uint64_t dropped_packets;
+    /* Packets which couldn't be written */
+    uint64_t failed_packets;
+};
+
+struct HwBackend;
+class Rendition;
+
 class FrameWriter
 {
     FrameWriterParams params;
     void load_codec_options(AVDictionary **dict);
 
-    SwsContext* swsCtx;
+    std::vector<ConversionSlice> conversion_slices;
+    std::shared_ptr<ThreadPool> conversion_pool;
+    yuv420p_converter simd_converter = NULL;
+    /* Whether encoder_frame already contains a complete converted frame */
+    bool converted_first_frame = false;
+    void convert_slice(const ConversionSlice& slice, const uint8_t *pixels,
+        int stride, int first_row, int last_row);
+    void convert_frame(const uint8_t *pixels, int stride);
+
+    /* Scales the frames of a rendition */
+    SwsContext *scale_ctx = NULL;
+    std::vector<std::unique_ptr<Rendition>> renditions;
+    void init_renditions();
+    AVFrame *upload_frame();
+
     AVOutputFormat* outputFmt;
     AVStream* videoStream;
     AVCodecContext* videoCodecCtx;
@@ -60,33 +227,151 @@ class FrameWriter
 
     AVBufferRef *hw_device_context = NULL;
     AVBufferRef *hw_frame_context = NULL;
+    /* Size of the surfaces allocated up front, 0 if the pool grows */
+    size_t hw_pool_bytes = 0;
+
+    /* Imports dmabufs as DRM PRIME frames and converts them to NV12 VAAPI
+     * surfaces on the GPU */
+    AVBufferRef *drm_device_context = NULL;
+    AVBufferRef *drm_frame_context = NULL;
+    AVFilterGraph *dmabuf_graph = NULL;
+    AVFilterContext *dmabuf_src = NULL;
+    AVFilterContext *dmabuf_sink = NULL;
+    void init_dmabuf_import();
 
     InputFormat *input_format;
+    /* NULL when encoding from system memory */
+    const HwBackend *hw_backend = NULL;
+    /* The format frames are converted to on the CPU, AV_PIX_FMT_NONE if the
+     * captured pixels are uploaded as they are */
+    AVPixelFormat conversion_format;
     void init_hw_accel();
     void init_sws();
     void init_codecs();
     void init_video_stream();
+    void init_encoder_threading(AVCodec *codec);
 
     AVFrame *encoder_frame = NULL;
+    /* Each frame is uploaded into a free surface of the pool of
+     * hw_frame_context, so the upload doesn't wait for the encoder to
+     * release the surface of the previous frame */
     AVFrame *hw_frame = NULL;
 
-    SwrContext *swrCtx;
-    AVStream *audioStream;
-    AVCodecContext *audioCodecCtx;
-    void init_swr();
-    void init_audio_stream();
-    void send_audio_pkt(AVFrame *frame);
+    /* Damage of the frame being encoded, in encoder frame coordinates
+     * (i.e after y-inversion). Empty if the whole frame is damaged. */
+    std::vector<FrameDamage> frame_damage;
+    void set_frame_damage(const std::vector<FrameDamage>& damage, bool y_invert);
+    void add_damage_hints(AVFrame *frame);
+
+    /* One audio stream, with its own encoder */
+    struct AudioTrack
+    {
+        AVStream *stream = NULL;
+        AVCodecContext *codec_ctx = NULL;
+        SwrContext *swr_ctx = NULL;
+
+        /* Reused for every audio frame, PulseAudio data goes straight into
+         * input_frame */
+        AVFrame *input_frame = NULL;
+        AVFrame *output_frame = NULL;
+        /* The pts of the next audio frame, in microseconds */
+        int64_t next_usec = AV_NOPTS_VALUE;
+    };
+    std::vector<AudioTrack> audio_tracks;
+    void init_audio_stream(AudioTrack& track);
+    AVFrame *alloc_audio_frame(AVSampleFormat format, uint64_t channel_layout,
+        int sample_rate, int nb_samples);
+    void send_audio_pkt(AudioTrack& track, AVFrame *frame);
+
+    void encode_frame(AVCodecContext *ctx, AVFrame *frame,
+        std::vector<AVPacket*>& packets);
+    void encode_video_frame(AVFrame *frame);
+    /* Takes ownership of the packet, which ctx encoded for stream */
+    void finish_frame(AVPacket *pkt, AVCodecContext *ctx, AVStream *stream);
+
+    /* Packets are written by a separate thread, so that slow I/O doesn't
+     * stall the encoder */
+    std::unique_ptr<PacketQueue> packet_queue;
+    std::thread muxer_thread;
+    std::atomic<uint64_t> written_packets{0};
+    std::atomic<uint64_t> total_write_usec{0};
+    std::atomic<uint64_t> max_write_usec{0};
+    std::atomic<uint64_t> dropped_packets{0};
+    std::atomic<uint64_t> failed_packets{0};
+    void muxer_loop();
+    void handle_write_error(int err);
+
+    /* When streaming, a dropped video packet breaks the references of the
+     * following ones, so video is dropped up to the next keyframe, which is
+     * requested from the encoder right away */
+    bool drop_until_keyframe = false;
+    bool keyframe_requested = false;
 
-    void finish_frame(AVPacket& pkt, bool isVideo);
+    /* Changes requested from other threads with the setters below, applied
+     * to the encoder before its next frame */
+    std::atomic<bool> forced_keyframe{false};
+    std::atomic<int64_t> pending_bitrate{0};
+    std::atomic<double> pending_crf{-1};
+    void apply_encoder_changes();
+    void queue_packet(AVPacket *pkt, bool is_video);
+
+    /* The file the muxer thread writes to. fmtCtx only holds the streams and
+     * their encoders, so that a new muxCtx can be opened for each segment
+     * without touching the encoders. */
+    AVFormatContext *muxCtx = NULL;
+    /* Counted once the segment is open, the encoder thread reads it to
+     * notice cuts */
+    std::atomic<int> nr_segments{0};
+    int64_t segment_start_usec = AV_NOPTS_VALUE;
+    std::atomic<size_t> segment_bytes{0};
+    std::deque<std::string> segment_files;
+    std::string get_output_file_name(int segment);
+    void open_segment();
+    void close_segment();
+    bool is_segment_due(AVPacket *pkt);
+
+    /* When the encoder should next produce a keyframe, so that a segment can
+     * start there */
+    int64_t next_keyframe_usec = 0;
+    /* The segment a keyframe was last forced for by --segment-size.
+     * Only used by the encoder thread. */
+    int size_keyframe_segment = 0;
+    void force_segment_keyframe(AVFrame *frame);
+
+    /* Frames with another layout than the encoder's are dropped, with a
+     * warning for the first one */
+    bool warned_layout_change = false;
 
 public :
     FrameWriter(const FrameWriterParams& params);
-    void add_frame(const uint8_t* pixels, int64_t usec, bool y_invert);
+    /* damage may be empty if it is unknown which parts of the frame changed */
+    void add_frame(const FrameShm& frame, int64_t usec, bool y_invert,
+        const std::vector<FrameDamage>& damage);
+    /* dmabuf frames can't be y-inverted */
+    void add_dmabuf_frame(const FrameDmabuf& dmabuf, int64_t usec);
 
-    /* Buffer must have size get_audio_buffer_size() */
-    void add_audio(const void* buffer);
+    /* For renditions: scale a converted frame of the main FrameWriter, then
+     * encode it. Split, so that the source can be reused in between. */
+    void scale_frame(const AVFrame *source);
+    void encode_scaled_frame(int64_t usec);
+
+    /* Returns a buffer of get_audio_buffer_size() bytes for the next audio
+     * frame of a track. Fill it, then call add_audio() with the time the first
+     * sample was captured, relative to the start of the video, to encode it. */
+    void *get_audio_buffer(size_t track);
+    void add_audio(size_t track, int64_t usec);
     size_t get_audio_buffer_size();
 
+    MuxerStats get_muxer_stats();
+
+    /* Can be called from any thread. The encoder may ignore a new bitrate
+     * or CRF if it can't be reconfigured while encoding, e.g libx264 only
+     * applies the one of the rate control mode it was opened with. */
+    void force_keyframe();
+    void set_bitrate(int64_t bitrate);
+    /* Returns false if the codec has no crf option */
+    bool set_crf(double crf);
+
     ~FrameWriter();
 };
 
@@ -94,8 +379,6 @@ public :
 #include <mutex>
 #include <atomic>
 
-extern std::mutex frame_writer_mutex, frame_writer_pending_mutex;
-extern std::unique_ptr<FrameWriter> frame_writer;
 extern std::atomic<bool> exit_main_loop;
 
 #endif // FRAME_WRITER
@@ -6,28 +6,49 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
 #include <getopt.h>
 
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <wayland-client-protocol.h>
+#include <gbm.h>
+#include <drm_fourcc.h>
 
 #include "frame-writer.hpp"
-#include "pulse.hpp"
+#include "audio-mixer.hpp"
+#include "raw-dump.hpp"
+#include "control-socket.hpp"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 
-std::mutex frame_writer_mutex, frame_writer_pending_mutex;
-std::unique_ptr<FrameWriter> frame_writer;
+/* Not in the headers of older C libraries */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 static struct wl_shm *shm = NULL;
 static struct zxdg_output_manager_v1 *xdg_output_manager = NULL;
 static struct zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
+static struct zwp_linux_dmabuf_v1 *dmabuf = NULL;
+static struct gbm_device *gbm_device = NULL;
+static int gbm_device_fd = -1;
 
 struct wf_recorder_output
 {
@@ -96,29 +117,268 @@ const zxdg_output_v1_listener xdg_output_implementation = {
     .description = handle_xdg_output_description
 };
 
+struct capture_region
+{
+    int32_t x, y;
+    int32_t width, height;
+
+    capture_region()
+        : capture_region(0, 0, 0, 0) {}
+
+    capture_region(int32_t _x, int32_t _y, int32_t _width, int32_t _height)
+        : x(_x), y(_y), width(_width), height(_height) { }
+
+    /* Make sure that dimension is even, while trying to keep the segment
+     * [coordinate, coordinate+dimension) as good as possible (i.e not going
+     * out of the monitor) */
+    void make_even(int32_t& coordinate, int32_t& dimension)
+    {
+        if (dimension % 2 == 0)
+            return;
+
+        /* We need to increase dimension to make it an even number */
+        ++dimension;
+
+        /* Try to decrease coordinate. If coordinate > 0, we can always lower it
+         * by 1 pixel and stay inside the screen. */
+        coordinate = std::max(coordinate - 1, 0);
+    }
+
+    void set_from_string(std::string geometry_string)
+    {
+        if (sscanf(geometry_string.c_str(), "%d,%d %dx%d", &x, &y, &width, &height) != 4)
+        {
+            fprintf(stderr, "Bad geometry: %s, capturing whole output instead.\n",
+                geometry_string.c_str());
+            x = y = width = height = 0;
+            return;
+        }
+
+        /* ffmpeg requires even width and height */
+        make_even(x, width);
+        make_even(y, height);
+        printf("Adjusted geometry: %d,%d %dx%d\n", x, y, width, height);
+    }
+
+    bool is_selected()
+    {
+        return width > 0 && height > 0;
+    }
+
+    bool contained_in(const capture_region& output)
+    {
+        return
+            output.x <= x &&
+            output.x + output.width >= x + width &&
+            output.y <= y &&
+            output.y + output.height >= y + height;
+    }
+};
+
+struct wf_shm_pool;
+
 struct wf_buffer
 {
     struct wl_buffer *wl_buffer;
     void *data;
+    /* The pool the shm buffer was carved out of, and which of its chunks.
+     * The chunk stays with the buffer when drop-oldest moves it to another
+     * slot of the ring. */
+    std::shared_ptr<wf_shm_pool> pool;
+    size_t pool_chunk;
     enum wl_shm_format format;
     int width, height, stride;
     bool y_invert;
+    std::vector<FrameDamage> damage;
+
+    /* Whether the compositor offered a dmabuf for the current frame */
+    bool dmabuf_offered;
+    uint32_t dmabuf_format;
+
+    bool is_dmabuf = false;
+    struct gbm_bo *bo = NULL;
+    FrameDmabuf dmabuf;
 
     timespec presented;
-    uint32_t base_usec;
+    int64_t base_usec;
 
-    std::atomic<bool> released{true}; // if the buffer can be used to store new pending frames
-    std::atomic<bool> available{false}; // if the buffer can be used to feed the encoder
+    /* When the frame was ready and when it was handed to the writer thread */
+    std::chrono::steady_clock::time_point ready_time, queued_time;
+
+    /* Guarded by buffers_mutex */
+    bool released = true; // if the buffer can be used to store new pending frames
+    bool available = false; // if the buffer can be used to feed the encoder
+    bool encoding = false; // if the writer thread is encoding the buffer
+    bool dropped = false; // if the writer thread should skip the buffer
 };
 
 std::atomic<bool> exit_main_loop{false};
 
 #define MAX_BUFFERS 16
-wf_buffer buffers[MAX_BUFFERS];
-size_t active_buffer = 0;
 
-bool buffer_copy_done = false;
+/* What to do when the encoder can't keep up and the buffers are full */
+enum overload_policy
+{
+    /* Wait for the encoder to release a buffer */
+    OVERLOAD_BLOCK,
+    /* Skip the oldest frame the encoder hasn't started yet */
+    OVERLOAD_DROP_OLDEST,
+    /* Replace the newest pending frame with the new one */
+    OVERLOAD_DROP_NEWEST,
+    /* Wait longer between captures while the buffers fill up */
+    OVERLOAD_THROTTLE,
+};
+
+overload_policy overload = OVERLOAD_BLOCK;
+
+/* Delay between captures with OVERLOAD_THROTTLE */
+#define MAX_THROTTLE_USEC 100000
+
+/* Upper limit of --encoder-threads */
+#define MAX_ENCODER_THREADS 128
+
+/* Muxer queue size when streaming, about a second of a 16 Mbit/s stream */
+#define STREAM_MUXER_QUEUE_SIZE (2 << 20)
+
+/* Upper limit of --capture-depth, well below MAX_BUFFERS so that the ring
+ * still has room for frames waiting for the encoder */
+#define MAX_CAPTURE_DEPTH 4
+
+/* GPU used by VAAPI when -d isn't given, for both the encoder and the
+ * dmabufs it reads */
+#define DEFAULT_RENDER_NODE "/dev/dri/renderD128"
+
+struct wf_capture;
+
+/* A screencopy request in flight, copying into its own slot of the ring.
+ * It is the data pointer of the frame listener. */
+struct wf_frame_request
+{
+    wf_capture *cap;
+    size_t slot;
+    struct zwlr_screencopy_frame_v1 *frame = NULL;
+    std::chrono::steady_clock::time_point request_time;
+    bool done = false;
+};
+
+/* An output or a region of an output being recorded. Each capture has its
+ * own ring of buffers, writer thread and encoder, so that a slow encoder
+ * doesn't hold back the other captures. */
+struct wf_capture
+{
+    wf_recorder_output *output;
+    capture_region region;
+    FrameWriterParams params;
+
+    wf_buffer buffers[MAX_BUFFERS];
+    /* Slots of the ring in use, only lowered by --memory-budget */
+    int nr_buffers = MAX_BUFFERS;
+    /* Memory of one slot, for the statistics */
+    size_t slot_bytes = 0;
+    /* The slot the next request copies into */
+    size_t active_buffer = 0;
+
+    /* The screencopy requests in flight, oldest first. Frames are handed to
+     * the writer thread in this order, so that the ring stays in order even
+     * if a later request completes first. */
+    std::deque<std::unique_ptr<wf_frame_request>> requests;
+    /* Presentation time of the last frame handed to the writer thread */
+    timespec last_presented = {0, 0};
+    uint64_t duplicate_frames = 0;
+
+    PipelineStats stats;
+
+    /* Guards the released/available flags of the buffers, so that the capture
+     * loop and the writer thread can sleep until the other side hands over
+     * a buffer */
+    std::mutex buffers_mutex;
+    std::condition_variable buffer_available_cv;
+    size_t pending_frames = 0; // buffers available to the encoder, guarded by buffers_mutex
+    /* Set when the capture loop found no free buffer, so that the writer
+     * thread wakes it up through capture_wakeup_fd once it releases one.
+     * Guarded by buffers_mutex. */
+    bool waiting_for_buffer = false;
+
+    std::atomic<uint64_t> dropped_frames{0};
+    int64_t throttle_usec = 0, peak_throttle_usec = 0;
+
+    /* The next screencopy request is sent no earlier than this, to honor
+     * --framerate and OVERLOAD_THROTTLE */
+    std::chrono::steady_clock::time_point next_capture;
+
+    /* The pool new shm buffers are carved out of */
+    std::shared_ptr<wf_shm_pool> shm_pool;
+
+    /* Cleared if the first dmabuf frame is y-inverted, which the dmabuf
+     * import can't flip. The capture then falls back to shm. */
+    bool dmabuf_usable = true;
+    bool warned_y_invert = false;
+
+    /* Allocates the pages of shm_pool in the background, see prefault_shm_pool() */
+    std::thread prefault_thread;
+
+    /* Started as soon as the layout of the first buffer is known. Until it
+     * is ready, frames are buffered instead of dropped by the overload
+     * policy, since the encoder isn't behind, just not open yet. */
+    std::thread writer_thread;
+    std::atomic<bool> writer_ready{false};
+    AudioMixerParams mixer_params;
+    /* CLOCK_MONOTONIC time of the first frame of any capture, in
+     * microseconds, set before the first buffer is handed over */
+    int64_t clock_origin_usec = -1;
+
+    /* The encoder of the writer thread, NULL until the first frame and for
+     * raw dumps. Control commands reach it through this pointer. */
+    std::mutex frame_writer_mutex;
+    FrameWriter *frame_writer = NULL;
+};
+
+std::vector<std::unique_ptr<wf_capture>> captures;
 
+/* Number of screencopy requests kept in flight per capture */
+int capture_depth = 1;
+
+/* --memory-budget in bytes, 0 for no limit */
+size_t memory_budget = 0;
+
+/* Whether the compositor should draw the cursor into the captured frames */
+bool overlay_cursor = true;
+
+/* Whether to use copy_with_damage if the compositor supports it */
+bool use_damage = true;
+
+/* Whether to capture into dmabufs if encoding with vaapi */
+bool use_dmabuf = true;
+
+/* Whether to dump the raw frames into the output file instead of encoding
+ * them, see --encode-raw */
+bool raw_dump = false;
+
+PauseState pause_state;
+/* CLOCK_MONOTONIC time of the last pause, in microseconds */
+int64_t pause_start_usec = 0;
+
+/* Receives commands from --control-socket, NULL if not given */
+std::unique_ptr<ControlSocket> control_socket;
+
+/* An eventfd the writer threads signal when they release a buffer which the
+ * capture loop is waiting for. It is polled together with the display, so
+ * that a capture whose ring is full doesn't hold back the other captures and
+ * the control socket. */
+int capture_wakeup_fd = -1;
+
+/* Stop the recording from another thread, e.g when the output can't be
+ * written anymore */
+static void request_exit()
+{
+    exit_main_loop = true;
+
+    uint64_t one = 1;
+    if (capture_wakeup_fd >= 0 && write(capture_wakeup_fd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "failed to wake up the capture loop: %m\n");
+}
+
+/* Fallback if memfd_create() isn't supported by the kernel */
 static int backingfile(off_t size)
 {
     char name[] = "/tmp/wf-recorder-shared-XXXXXX";
@@ -140,47 +400,261 @@ static int backingfile(off_t size)
     return fd;
 }
 
-static struct wl_buffer *create_shm_buffer(uint32_t fmt,
-    int width, int height, int stride, void **data_out)
+static int create_shm_file(off_t size)
 {
-    int size = stride * height;
+    int fd = memfd_create("wf-recorder-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return backingfile(size);
 
-    int fd = backingfile(size);
-    if (fd < 0) {
-        fprintf(stderr, "creating a buffer file for %d B failed: %m\n", size);
-        return NULL;
+    int ret;
+    while ((ret = ftruncate(fd, size)) < 0 && errno == EINTR) {
+        // No-op
+    }
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* The compositor maps the pool too, make sure it can't be resized
+     * under its feet */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    return fd;
+}
+
+/* A single shm file that all ring slots are carved out of. When the
+ * compositor asks for a different buffer layout, a new pool is created,
+ * and old pools stay alive until no slot uses them anymore. */
+struct wf_shm_pool
+{
+    int fd = -1;
+    void *data = MAP_FAILED;
+    size_t size = 0;
+    struct wl_shm_pool *wl_pool = NULL;
+
+    uint32_t format;
+    int width, height, stride;
+
+    ~wf_shm_pool()
+    {
+        if (wl_pool)
+            wl_shm_pool_destroy(wl_pool);
+        if (data != MAP_FAILED)
+            munmap(data, size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    size_t slot_size() const
+    {
+        return (size_t)stride * height;
     }
 
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
+    bool matches(const wf_buffer& buffer) const;
+};
+
+static std::shared_ptr<wf_shm_pool> create_shm_pool(uint32_t fmt,
+    int width, int height, int stride, int nr_slots)
+{
+    auto pool = std::make_shared<wf_shm_pool>();
+    pool->format = fmt;
+    pool->width = width;
+    pool->height = height;
+    pool->stride = stride;
+    pool->size = pool->slot_size() * nr_slots;
+
+    pool->fd = create_shm_file(pool->size);
+    if (pool->fd < 0) {
+        fprintf(stderr, "creating a buffer file for %zu B failed: %m\n", pool->size);
+        return nullptr;
+    }
+
+    pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        pool->fd, 0);
+    if (pool->data == MAP_FAILED) {
         fprintf(stderr, "mmap failed: %m\n");
-        close(fd);
+        return nullptr;
+    }
+
+    /* Fewer TLB misses when converting, if shmem THP is enabled */
+    madvise(pool->data, pool->size, MADV_HUGEPAGE);
+
+    pool->wl_pool = wl_shm_create_pool(shm, pool->fd, pool->size);
+    return pool;
+}
+
+bool wf_shm_pool::matches(const wf_buffer& buffer) const
+{
+    return format == (uint32_t)buffer.format && width == buffer.width &&
+        height == buffer.height && stride == buffer.stride;
+}
+
+/* Allocate the pages of the capture's new pool on another thread, so that
+ * the compositor doesn't have to fault them in while copying the first frames
+ * into each slot. The pages are only allocated, their content is left alone,
+ * so the compositor can already copy into the first slot meanwhile. */
+static void prefault_shm_pool(wf_capture& cap)
+{
+    void *data = cap.shm_pool->data;
+    size_t size = cap.shm_pool->size;
+    cap.prefault_thread = std::thread([=] () {
+        /* Fails harmlessly on kernels older than 5.14 */
+        madvise(data, size, MADV_POPULATE_WRITE);
+    });
+}
+
+/* Point the slot at its chunk of the capture's pool, creating a new pool
+ * first if the compositor asked for a different layout */
+static struct wl_buffer *attach_shm_buffer(wf_capture& cap, size_t slot)
+{
+    auto& buffer = cap.buffers[slot];
+    if (!cap.shm_pool || !cap.shm_pool->matches(buffer))
+    {
+        if (cap.prefault_thread.joinable())
+            cap.prefault_thread.join();
+
+        cap.shm_pool = create_shm_pool(buffer.format,
+            buffer.width, buffer.height, buffer.stride, cap.nr_buffers);
+        if (!cap.shm_pool)
+            return NULL;
+
+        prefault_shm_pool(cap);
+    }
+
+    if (buffer.wl_buffer && buffer.pool == cap.shm_pool)
+        return buffer.wl_buffer;
+
+    if (buffer.wl_buffer)
+        wl_buffer_destroy(buffer.wl_buffer);
+
+    size_t offset = cap.shm_pool->slot_size() * buffer.pool_chunk;
+    buffer.pool = cap.shm_pool;
+    buffer.data = (char*)cap.shm_pool->data + offset;
+    return wl_shm_pool_create_buffer(cap.shm_pool->wl_pool, offset,
+        buffer.width, buffer.height, buffer.stride, buffer.format);
+}
+
+/* wl_shm formats are DRM fourcc codes, except for the two mandatory formats */
+static wl_shm_format drm_to_shm_format(uint32_t format)
+{
+    if (format == DRM_FORMAT_ARGB8888)
+        return WL_SHM_FORMAT_ARGB8888;
+    if (format == DRM_FORMAT_XRGB8888)
+        return WL_SHM_FORMAT_XRGB8888;
+
+    return (wl_shm_format)format;
+}
+
+static struct wl_buffer *create_dmabuf_buffer(wf_buffer& buffer)
+{
+    buffer.bo = gbm_bo_create(gbm_device, buffer.width, buffer.height,
+        buffer.dmabuf_format, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+    if (!buffer.bo)
+    {
+        fprintf(stderr, "failed to create a %dx%d buffer object\n",
+            buffer.width, buffer.height);
         return NULL;
     }
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    close(fd);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-        stride, fmt);
-    wl_shm_pool_destroy(pool);
+    auto& desc = buffer.dmabuf;
+    desc.fd = gbm_bo_get_fd(buffer.bo);
+    desc.format = buffer.dmabuf_format;
+    desc.modifier = gbm_bo_get_modifier(buffer.bo);
+    desc.size = lseek(desc.fd, 0, SEEK_END);
+    desc.nr_planes = std::min(gbm_bo_get_plane_count(buffer.bo), AV_DRM_MAX_PLANES);
+
+    auto params = zwp_linux_dmabuf_v1_create_params(dmabuf);
+    for (int i = 0; i < desc.nr_planes; i++)
+    {
+        desc.offset[i] = gbm_bo_get_offset(buffer.bo, i);
+        desc.stride[i] = gbm_bo_get_stride_for_plane(buffer.bo, i);
+        zwp_linux_buffer_params_v1_add(params, desc.fd, i, desc.offset[i],
+            desc.stride[i], desc.modifier >> 32, desc.modifier & 0xffffffff);
+    }
 
-    *data_out = data;
-    return buffer;
+    auto wl_buffer = zwp_linux_buffer_params_v1_create_immed(params,
+        buffer.width, buffer.height, buffer.dmabuf_format, 0);
+    zwp_linux_buffer_params_v1_destroy(params);
+
+    return wl_buffer;
 }
 
-static void frame_handle_buffer(void *, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
-    uint32_t width, uint32_t height, uint32_t stride)
+static void destroy_dmabuf_buffer(wf_buffer& buffer)
 {
-    auto& buffer = buffers[active_buffer];
+    if (buffer.wl_buffer)
+        wl_buffer_destroy(buffer.wl_buffer);
+    buffer.wl_buffer = NULL;
 
-    buffer.format = (wl_shm_format)format;
-    buffer.width = width;
-    buffer.height = height;
-    buffer.stride = stride;
+    close(buffer.dmabuf.fd);
+    gbm_bo_destroy(buffer.bo);
+    buffer.bo = NULL;
+    buffer.is_dmabuf = false;
+}
+
+static void start_writer_thread(wf_capture& cap, wf_buffer& buffer);
+
+/* Whether the compositor sends the damage of the request's frame */
+static bool copies_damage(const wf_frame_request& req)
+{
+    return use_damage && zwlr_screencopy_frame_v1_get_version(req.frame) >= 2;
+}
+
+/* Split --memory-budget between the capture ring and the encoder of the
+ * capture, once the size of a frame is known. The ring gets at most half of
+ * the share of the capture, but never fewer slots than the requests in flight
+ * plus one frame waiting for the encoder. */
+static void apply_memory_budget(wf_capture& cap, const wf_buffer& buffer)
+{
+    cap.slot_bytes = (size_t)std::max(buffer.stride, buffer.width * 4) * buffer.height;
+    if (memory_budget == 0)
+    {
+        cap.stats.capture_ring.set_limit(cap.nr_buffers * cap.slot_bytes);
+        return;
+    }
+
+    size_t share = memory_budget / captures.size();
+    size_t nr_buffers = share / 2 / std::max<size_t>(cap.slot_bytes, 1);
+    cap.nr_buffers = std::min<size_t>(MAX_BUFFERS,
+        std::max<size_t>(capture_depth + 1, nr_buffers));
 
-    if (!buffer.wl_buffer) {
-        buffer.wl_buffer =
-            create_shm_buffer(format, width, height, stride, &buffer.data);
+    size_t ring_bytes = cap.nr_buffers * cap.slot_bytes;
+    if (ring_bytes >= share)
+    {
+        std::cerr << "Warning: the capture ring alone needs " << (ring_bytes >> 20)
+            << " MiB, more than the memory budget of " << (share >> 20) << " MiB" << std::endl;
+    }
+
+    /* Down to the minimum sizes of the encoder, 0 would lift the limits */
+    cap.params.memory_budget = ring_bytes < share ? share - ring_bytes : 1;
+    cap.stats.capture_ring.set_limit(ring_bytes);
+}
+
+/* Allocate the buffer of the request's slot if necessary and start the copy */
+static void request_copy(wf_frame_request& req)
+{
+    auto& cap = *req.cap;
+    auto& buffer = cap.buffers[req.slot];
+
+    /* The ring has to be sized before its first pool is created */
+    if (cap.slot_bytes == 0)
+        apply_memory_budget(cap, buffer);
+
+    if (buffer.is_dmabuf && !cap.dmabuf_usable)
+        destroy_dmabuf_buffer(buffer);
+
+    if (!buffer.wl_buffer)
+    {
+        buffer.is_dmabuf = gbm_device && cap.dmabuf_usable && buffer.dmabuf_offered;
+        if (buffer.is_dmabuf)
+            buffer.wl_buffer = create_dmabuf_buffer(buffer);
+    }
+
+    if (!buffer.is_dmabuf)
+        buffer.wl_buffer = attach_shm_buffer(cap, req.slot);
+
+    if (buffer.is_dmabuf)
+    {
+        buffer.format = drm_to_shm_format(buffer.dmabuf_format);
+        buffer.stride = buffer.dmabuf.stride[0];
     }
 
     if (buffer.wl_buffer == NULL) {
@@ -188,22 +662,114 @@ static void frame_handle_buffer(void *, struct zwlr_screencopy_frame_v1 *frame,
         exit(EXIT_FAILURE);
     }
 
-    zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
+    /* The layout is known now, so the encoder can be opened while the
+     * compositor copies the frame. With dmabufs, it waits for the flags of
+     * the frame, see frame_handle_flags(). */
+    if (!cap.writer_thread.joinable() && !buffer.is_dmabuf)
+        start_writer_thread(cap, buffer);
+
+    /* With copy_with_damage, the compositor sends the frame only once
+     * something has changed on the screen, so static content isn't encoded
+     * over and over again */
+    if (copies_damage(req))
+        zwlr_screencopy_frame_v1_copy_with_damage(req.frame, buffer.wl_buffer);
+    else
+        zwlr_screencopy_frame_v1_copy(req.frame, buffer.wl_buffer);
 }
 
-static void frame_handle_flags(void*, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
-    buffers[active_buffer].y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+    uint32_t width, uint32_t height, uint32_t stride)
+{
+    auto& req = *(wf_frame_request*)data;
+    auto& buffer = req.cap->buffers[req.slot];
+
+    buffer.format = (wl_shm_format)format;
+    buffer.width = width;
+    buffer.height = height;
+    buffer.stride = stride;
+
+    /* Starting with version 3, the compositor may also offer a dmabuf,
+     * so we wait for buffer_done before choosing */
+    if (zwlr_screencopy_frame_v1_get_version(frame) < 3)
+        request_copy(req);
+}
+
+static void frame_handle_linux_dmabuf(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t format, uint32_t width, uint32_t height)
+{
+    auto& req = *(wf_frame_request*)data;
+    auto& buffer = req.cap->buffers[req.slot];
+
+    buffer.dmabuf_offered = true;
+    buffer.dmabuf_format = format;
+    buffer.width = width;
+    buffer.height = height;
+}
+
+static void frame_handle_buffer_done(void *data, struct zwlr_screencopy_frame_v1 *)
+{
+    request_copy(*(wf_frame_request*)data);
 }
 
-static void frame_handle_ready(void *, struct zwlr_screencopy_frame_v1 *,
+static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
+    auto& req = *(wf_frame_request*)data;
+    auto& cap = *req.cap;
+    auto& buffer = cap.buffers[req.slot];
+    buffer.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+
+    /* dmabuf frames can't be flipped, so a compositor sending them
+     * y-inverted is recorded through shm instead. The frames copied into
+     * dmabufs until then are skipped. */
+    if (buffer.is_dmabuf && !cap.writer_thread.joinable() && cap.dmabuf_usable)
+    {
+        if (!buffer.y_invert)
+        {
+            start_writer_thread(cap, buffer);
+        } else
+        {
+            fprintf(stderr, "compositor sends y-inverted dmabufs, "
+                "capturing into shared memory\n");
+            cap.dmabuf_usable = false;
+        }
+    }
+}
+
+/* Whether the writer thread can't encode the captured frame, see
+ * frame_handle_flags() */
+static bool is_unusable_dmabuf(wf_capture& cap, const wf_buffer& buffer)
+{
+    if (!buffer.is_dmabuf)
+        return false;
+
+    if (cap.dmabuf_usable && buffer.y_invert && !cap.warned_y_invert)
+    {
+        fprintf(stderr, "compositor sent a y-inverted dmabuf, skipping it\n");
+        cap.warned_y_invert = true;
+    }
+
+    return !cap.dmabuf_usable || buffer.y_invert;
+}
+
+static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *,
     uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec) {
 
-    auto& buffer = buffers[active_buffer];
-    buffer_copy_done = true;
+    auto& req = *(wf_frame_request*)data;
+    auto& buffer = req.cap->buffers[req.slot];
+    req.done = true;
+    buffer.ready_time = std::chrono::steady_clock::now();
+    req.cap->stats.capture.record_since(req.request_time);
     buffer.presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
     buffer.presented.tv_nsec = tv_nsec;
 }
 
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    auto& req = *(wf_frame_request*)data;
+    req.cap->buffers[req.slot].damage.push_back(
+        {(int)x, (int)y, (int)width, (int)height});
+}
+
 static void frame_handle_failed(void *, struct zwlr_screencopy_frame_v1 *) {
     fprintf(stderr, "failed to copy frame\n");
     exit_main_loop = true;
@@ -214,10 +780,13 @@ static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
     .flags = frame_handle_flags,
     .ready = frame_handle_ready,
     .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
+    .linux_dmabuf = frame_handle_linux_dmabuf,
+    .buffer_done = frame_handle_buffer_done,
 };
 
 static void handle_global(void*, struct wl_registry *registry,
-    uint32_t name, const char *interface, uint32_t) {
+    uint32_t name, const char *interface, uint32_t version) {
 
     if (strcmp(interface, wl_output_interface.name) == 0)
     {
@@ -233,7 +802,12 @@ static void handle_global(void*, struct wl_registry *registry,
     else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0)
     {
         screencopy_manager = (zwlr_screencopy_manager_v1*) wl_registry_bind(registry, name,
-            &zwlr_screencopy_manager_v1_interface, 1);
+            &zwlr_screencopy_manager_v1_interface, std::min(version, 3u)); // version 2 for copy_with_damage, 3 for dmabufs, if available
+    }
+    else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0 && version >= 2)
+    {
+        dmabuf = (zwp_linux_dmabuf_v1*) wl_registry_bind(registry, name,
+            &zwp_linux_dmabuf_v1_interface, 2); // version 2 for create_immed
     }
     else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0)
     {
@@ -256,9 +830,217 @@ static uint64_t timespec_to_usec (const timespec& ts)
     return ts.tv_sec * 1000000ll + 1ll * ts.tv_nsec / 1000ll;
 }
 
-static int next_frame(int frame)
+static int next_frame(const wf_capture& cap, int frame)
+{
+    return (frame + 1) % cap.nr_buffers;
+}
+
+static int prev_frame(const wf_capture& cap, int frame)
+{
+    return (frame + cap.nr_buffers - 1) % cap.nr_buffers;
+}
+
+/* Damage is relative to the previous frame, so when a frame is dropped, its
+ * damage has to be added to the next one. Empty damage means the whole frame. */
+static void merge_damage(std::vector<FrameDamage>& into,
+    const std::vector<FrameDamage>& dropped, int width, int height)
+{
+    if (dropped.empty())
+        into.push_back({0, 0, width, height});
+    else
+        into.insert(into.end(), dropped.begin(), dropped.end());
+}
+
+/* Drop the oldest frame the encoder hasn't started yet, and move its buffer to
+ * the newest slot of the ring, so that the next capture can reuse it right
+ * away while the frames stay in order. The slots in between move back by one.
+ * Called with buffers_mutex held. Returns false if there is no such frame. */
+static bool drop_oldest_frame(wf_capture& cap)
+{
+    /* The writer thread only touches the oldest slot without the lock,
+     * and only while encoding it or skipping it as dropped */
+    size_t oldest = cap.active_buffer;
+    if (cap.buffers[oldest].encoding)
+        oldest = next_frame(cap, oldest);
+
+    auto& victim = cap.buffers[oldest];
+    if (!victim.available || victim.encoding || victim.dropped)
+        return false;
+
+    /* Damage is relative to the previous frame, so the frame after the
+     * victim gets its damage too */
+    std::vector<FrameDamage> damage;
+    merge_damage(damage, victim.damage, victim.width, victim.height);
+
+    size_t newest = prev_frame(cap, cap.active_buffer);
+    if (oldest != newest)
+    {
+        size_t following_slot = next_frame(cap, oldest);
+        auto& following = cap.buffers[following_slot];
+
+        /* Empty damage of a captured frame means the whole frame, and so
+         * does the damage of a frame in flight without copy_with_damage */
+        bool partial = !following.damage.empty();
+        for (auto& req : cap.requests)
+        {
+            if (req->slot == following_slot)
+                partial = copies_damage(*req);
+        }
+
+        if (partial)
+            following.damage.insert(following.damage.end(), damage.begin(), damage.end());
+        damage.clear();
+    }
+
+    for (size_t i = oldest; i != newest; i = next_frame(cap, i))
+    {
+        size_t next = next_frame(cap, i);
+        std::swap(cap.buffers[i], cap.buffers[next]);
+        for (auto& req : cap.requests)
+        {
+            if (req->slot == next)
+                req->slot = i;
+        }
+    }
+
+    /* The victim is the newest slot now */
+    auto& freed = cap.buffers[newest];
+    freed.available = false;
+    freed.damage = damage;
+    --cap.pending_frames;
+    ++cap.dropped_frames;
+    cap.stats.capture_ring.set_used(cap.pending_frames * cap.slot_bytes);
+
+    cap.active_buffer = newest;
+    return true;
+}
+
+/* Make active_buffer point to a buffer which can be used for the next capture,
+ * applying the overload policy if all buffers are in use.
+ * Returns false without waiting if there is none yet, the writer thread then
+ * signals capture_wakeup_fd once it releases one. */
+static bool acquire_capture_buffer(wf_capture& cap)
 {
-    return (frame + 1) % MAX_BUFFERS;
+    std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+    if (!cap.buffers[cap.active_buffer].released && cap.writer_ready)
+    {
+        if (overload == OVERLOAD_DROP_NEWEST)
+        {
+            /* The newest frame can't be in the encoder if all buffers are full,
+             * so it can be overwritten in place */
+            auto& newest = cap.buffers[prev_frame(cap, cap.active_buffer)];
+            if (newest.available && !newest.encoding)
+            {
+                newest.available = false;
+                --cap.pending_frames;
+                ++cap.dropped_frames;
+
+                std::vector<FrameDamage> damage;
+                merge_damage(damage, newest.damage, newest.width, newest.height);
+                newest.damage = damage;
+
+                cap.active_buffer = prev_frame(cap, cap.active_buffer);
+                return true;
+            }
+        } else if (overload == OVERLOAD_DROP_OLDEST)
+        {
+            if (drop_oldest_frame(cap))
+                return true;
+        }
+    }
+
+    auto& buffer = cap.buffers[cap.active_buffer];
+    if (!buffer.released)
+    {
+        cap.waiting_for_buffer = true;
+        return false;
+    }
+
+    buffer.damage.clear();
+    return true;
+}
+
+/* Space out the screencopy requests of a capture to the given framerate */
+static void limit_framerate(wf_capture& cap, int framerate)
+{
+    /* Don't try to catch up after falling behind */
+    auto now = std::chrono::steady_clock::now();
+    cap.next_capture = std::max(now, cap.next_capture) +
+        std::chrono::microseconds(1000000 / framerate);
+}
+
+/* With OVERLOAD_THROTTLE, back off exponentially while more than half of the
+ * buffers are waiting for the encoder, and speed up again once it catches up */
+static void throttle_capture(wf_capture& cap)
+{
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+        pending = cap.pending_frames;
+    }
+
+    if (pending > (size_t)cap.nr_buffers / 2)
+        cap.throttle_usec = std::min<int64_t>(cap.throttle_usec * 2 + 1000, MAX_THROTTLE_USEC);
+    else if (pending < (size_t)cap.nr_buffers / 4)
+        cap.throttle_usec /= 2;
+
+    cap.peak_throttle_usec = std::max(cap.peak_throttle_usec, cap.throttle_usec);
+    cap.next_capture = std::max(cap.next_capture, std::chrono::steady_clock::now() +
+        std::chrono::microseconds(cap.throttle_usec));
+}
+
+/* Hand over a captured buffer to the writer thread. Duplicate frames are
+ * passed as dropped, so that the writer thread only releases them. */
+static void set_buffer_available(wf_capture& cap, wf_buffer& buffer, bool duplicate)
+{
+    {
+        std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+        buffer.released = false;
+        buffer.available = true;
+        buffer.dropped = duplicate;
+        ++cap.pending_frames;
+        cap.stats.capture_ring.set_used(cap.pending_frames * cap.slot_bytes);
+    }
+
+    cap.buffer_available_cv.notify_one();
+}
+
+/* Block until the capture loop has filled the buffer.
+ * Returns false if there are no more frames to encode. */
+static bool wait_buffer_available(wf_capture& cap, wf_buffer& buffer)
+{
+    std::unique_lock<std::mutex> lock(cap.buffers_mutex);
+    cap.buffer_available_cv.wait(lock, [&] () {
+        return buffer.available || exit_main_loop;
+    });
+
+    buffer.encoding = buffer.available && !buffer.dropped;
+    return buffer.available;
+}
+
+/* Give an encoded buffer back to the capture loop */
+static void set_buffer_released(wf_capture& cap, wf_buffer& buffer)
+{
+    bool wake_up;
+    {
+        std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+        buffer.available = false;
+        buffer.released = true;
+        buffer.encoding = false;
+        buffer.dropped = false;
+        --cap.pending_frames;
+        cap.stats.capture_ring.set_used(cap.pending_frames * cap.slot_bytes);
+
+        wake_up = cap.waiting_for_buffer;
+        cap.waiting_for_buffer = false;
+    }
+
+    if (wake_up)
+    {
+        uint64_t one = 1;
+        if (write(capture_wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "failed to wake up the capture loop: %m\n");
+    }
 }
 
 static InputFormat get_input_format(wf_buffer& buffer)
@@ -277,7 +1059,9 @@ static InputFormat get_input_format(wf_buffer& buffer)
     std::exit(0);
 }
 
-static void write_loop(FrameWriterParams params, PulseReaderParams pulseParams)
+/* The layout of the first buffer is the one the encoder is opened with */
+static void write_loop(wf_capture& cap, InputFormat format, int width, int height,
+    bool is_dmabuf)
 {
     /* Ignore SIGINT, main loop is responsible for the exit_main_loop signal */
     sigset_t sigset;
@@ -285,53 +1069,152 @@ static void write_loop(FrameWriterParams params, PulseReaderParams pulseParams)
     sigaddset(&sigset, SIGINT);
     pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
+    /* The thread inherits the mask of the capture thread. FrameWriter moves
+     * encoding threads to the encoder CPUs, raw dumps have to do it here. */
+    if (raw_dump && !cap.params.encoder_cpus.empty() &&
+        !set_thread_affinity(cap.params.encoder_cpus))
+    {
+        std::cerr << "Failed to set the CPU affinity of the raw dump" << std::endl;
+    }
+
+    FrameWriterParams params = cap.params;
+    params.format = format;
+    params.dmabuf = is_dmabuf;
+    params.width = width;
+    params.height = height;
+
     int last_encoded_frame = 0;
-    std::unique_ptr<PulseReader> pr;
+    std::unique_ptr<FrameWriter> frame_writer;
+    std::unique_ptr<RawDumpWriter> dump;
+    std::unique_ptr<AudioMixer> mixer;
+    bool mixer_started = false;
+
+    /* The encoder, muxer and audio sources are opened while the compositor
+     * copies the first frame. Until then, frames are buffered. */
+    if (!raw_dump)
+    {
+        frame_writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
+        if (params.enable_audio)
+        {
+            auto mixer_params = cap.mixer_params;
+            mixer_params.audio_frame_size = frame_writer->get_audio_buffer_size();
+            mixer_params.frame_writer = frame_writer.get();
+            mixer_params.stats = params.stats;
+            mixer = std::unique_ptr<AudioMixer> (new AudioMixer(mixer_params));
+        }
+
+        std::lock_guard<std::mutex> lock(cap.frame_writer_mutex);
+        cap.frame_writer = frame_writer.get();
+    }
+
+    cap.writer_ready = true;
+
+    /* Damage of the frames dropped since the last encoded frame */
+    std::vector<FrameDamage> dropped_damage;
+    bool warned_size_change = false;
 
     while(!exit_main_loop)
     {
-        // wait for frame to become available
-        while(buffers[last_encoded_frame].available != true) {
-            std::this_thread::sleep_for(std::chrono::microseconds(1000));
+        auto& buffer = cap.buffers[last_encoded_frame];
+        if (!wait_buffer_available(cap, buffer))
+            break;
+
+        cap.stats.queue_wait.record_since(buffer.queued_time);
+        if (buffer.dropped)
+        {
+            merge_damage(dropped_damage, buffer.damage, buffer.width, buffer.height);
+            set_buffer_released(cap, buffer);
+            last_encoded_frame = next_frame(cap, last_encoded_frame);
+            continue;
         }
-        auto& buffer = buffers[last_encoded_frame];
 
-        frame_writer_pending_mutex.lock();
-        frame_writer_mutex.lock();
-        frame_writer_pending_mutex.unlock();
+        if (!dropped_damage.empty() && !buffer.damage.empty())
+            merge_damage(buffer.damage, dropped_damage, buffer.width, buffer.height);
+        dropped_damage.clear();
 
-        if (!frame_writer)
+        if ((frame_writer || dump) &&
+            (buffer.width != params.width || buffer.height != params.height))
         {
-            /* This is the first time buffer attributes are available */
-            params.format = get_input_format(buffer);
-            params.width = buffer.width;
-            params.height = buffer.height;
-            frame_writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
-
-            if (params.enable_audio)
+            /* The encoder can't change its size midway, and reading the
+             * buffer with the old layout would go out of bounds */
+            if (!warned_size_change)
             {
-                pulseParams.audio_frame_size = frame_writer->get_audio_buffer_size();
-                pr = std::unique_ptr<PulseReader> (new PulseReader(pulseParams));
-                pr->start();
+                fprintf(stderr, "%s: output size changed to %dx%d, dropping frames\n",
+                    params.file.c_str(), buffer.width, buffer.height);
+                warned_size_change = true;
             }
+
+            set_buffer_released(cap, buffer);
+            last_encoded_frame = next_frame(cap, last_encoded_frame);
+            continue;
         }
 
-        frame_writer->add_frame((unsigned char*)buffer.data, buffer.base_usec,
-            buffer.y_invert);
+        FrameShm frame;
+        frame.pixels = (const uint8_t*)buffer.data;
+        frame.format = get_input_format(buffer);
+        frame.width = buffer.width;
+        frame.height = buffer.height;
+        frame.stride = buffer.stride;
 
-        frame_writer_mutex.unlock();
+        if (raw_dump)
+        {
+            if (!dump)
+            {
+                params.width = buffer.width;
+                params.height = buffer.height;
+                dump = std::unique_ptr<RawDumpWriter> (new RawDumpWriter(params.file, frame));
+            }
 
-        buffer.available = false;
-        buffer.released = true;
+            dump->add_frame(frame, buffer.base_usec, buffer.y_invert);
+            set_buffer_released(cap, buffer);
+            last_encoded_frame = next_frame(cap, last_encoded_frame);
+            continue;
+        }
+
+        /* The audio is aligned to the first frame, which is only known now */
+        if (mixer && !mixer_started)
+        {
+            mixer->start(cap.clock_origin_usec);
+            mixer_started = true;
+        }
 
-        last_encoded_frame = next_frame(last_encoded_frame);
+        if (buffer.is_dmabuf)
+        {
+            frame_writer->add_dmabuf_frame(buffer.dmabuf, buffer.base_usec);
+        } else
+        {
+            frame_writer->add_frame(frame, buffer.base_usec,
+                buffer.y_invert, buffer.damage);
+        }
+
+        set_buffer_released(cap, buffer);
+        last_encoded_frame = next_frame(cap, last_encoded_frame);
     }
 
-    std::lock_guard<std::mutex> lock(frame_writer_mutex);
-    /* Free the PulseReader connection first. This way it'd flush any remaining
+    /* Free the AudioMixer first. This way it'd flush any remaining
      * frames to the FrameWriter */
-    pr = nullptr;
+    mixer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(cap.frame_writer_mutex);
+        cap.frame_writer = NULL;
+    }
     frame_writer = nullptr;
+
+    if (dump)
+    {
+        printf("Dumped %lu raw frames to %s\n",
+            (unsigned long)dump->get_nr_frames(), params.file.c_str());
+    }
+}
+
+static void start_writer_thread(wf_capture& cap, wf_buffer& buffer)
+{
+    InputFormat format = get_input_format(buffer);
+    int width = buffer.width, height = buffer.height;
+    bool is_dmabuf = buffer.is_dmabuf;
+    cap.writer_thread = std::thread([&cap, format, width, height, is_dmabuf] () {
+        write_loop(cap, format, width, height, is_dmabuf);
+    });
 }
 
 void handle_sigint(int)
@@ -364,117 +1247,457 @@ static void check_has_protos()
 }
 
 wl_display *display = NULL;
+/* A roundtrip dispatches everything the compositor sent before answering it,
+ * so one is enough to receive all events caused by our previous requests */
 static void sync_wayland()
 {
-    wl_display_dispatch(display);
     wl_display_roundtrip(display);
 }
 
+/* Like wl_display_dispatch(), but returns 0 without dispatching anything if
+ * interrupted by a signal or if nothing arrived within timeout_ms (-1 waits
+ * forever). wl_display_dispatch() restarts polling in that case,
+ * which would make it impossible to stop the recording while waiting for
+ * damage on a static screen. */
+static int dispatch_wayland_events(int timeout_ms)
+{
+    while (wl_display_prepare_read(display) != 0)
+        wl_display_dispatch_pending(display);
+    wl_display_flush(display);
+
+    /* The control socket and the released buffers are served from here
+     * too, so that they wake up the capture loop */
+    std::vector<pollfd> fds(2);
+    fds[0].fd = wl_display_get_fd(display);
+    fds[0].events = POLLIN;
+    fds[1].fd = capture_wakeup_fd;
+    fds[1].events = POLLIN;
+    if (control_socket)
+        control_socket->add_poll_fds(fds);
+
+    int ret = poll(fds.data(), fds.size(), timeout_ms);
+    if (ret > 0 && fds[1].revents)
+    {
+        /* The capture loop checks all captures for free buffers anyway */
+        uint64_t count;
+        if (read(capture_wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "failed to read the capture wake up: %m\n");
+    }
+
+    if (ret > 0 && control_socket)
+        control_socket->dispatch(fds);
+
+    if (ret <= 0 || !fds[0].revents)
+    {
+        wl_display_cancel_read(display);
+        return (ret >= 0 || errno == EINTR) ? 0 : -1;
+    }
+
+    if (wl_display_read_events(display) < 0)
+        return -1;
+
+    return wl_display_dispatch_pending(display);
+}
+
+
+/* Open the GPU used for encoding, so that frames can be captured into
+ * dmabufs it can read directly. Falls back to wl_shm on failure. */
+static void init_gbm_device(const std::string& device)
+{
+    if (!dmabuf)
+    {
+        fprintf(stderr, "compositor doesn't support linux-dmabuf, "
+            "capturing into shared memory\n");
+        return;
+    }
+
+    int fd = open(device.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "failed to open %s: %m, capturing into shared memory\n",
+            device.c_str());
+        return;
+    }
+
+    gbm_device = gbm_create_device(fd);
+    if (!gbm_device)
+    {
+        fprintf(stderr, "failed to create gbm device for %s, "
+            "capturing into shared memory\n", device.c_str());
+        close(fd);
+        return;
+    }
+
+    /* The gbm device doesn't take ownership of the fd */
+    gbm_device_fd = fd;
+}
 
 static void load_output_info()
 {
-    for (auto& wo : available_outputs)
+    for (auto& wo : available_outputs)
+    {
+        wo.zxdg_output = zxdg_output_manager_v1_get_xdg_output(
+            xdg_output_manager, wo.output);
+        zxdg_output_v1_add_listener(wo.zxdg_output,
+            &xdg_output_implementation, NULL);
+    }
+
+    sync_wayland();
+}
+
+static wf_recorder_output* choose_interactive()
+{
+    fprintf(stdout, "Please select an output from the list to capture (enter output no.):\n");
+
+    int i = 1;
+    for (auto& wo : available_outputs)
+    {
+        printf("%d. Name: %s Description: %s\n", i++, wo.name.c_str(),
+            wo.description.c_str());
+    }
+
+    printf("Enter output no.:");
+    fflush(stdout);
+
+    int choice;
+    if (scanf("%d", &choice) != 1 || choice > (int)available_outputs.size() || choice <= 0)
+        return nullptr;
+
+    return &available_outputs[choice - 1];
+}
+
+/* Send a screencopy request for the active slot, which has to be acquired
+ * with acquire_capture_buffer() first */
+static void start_capture(wf_capture& cap)
+{
+    std::unique_ptr<wf_frame_request> req(new wf_frame_request);
+    req->cap = &cap;
+    req->slot = cap.active_buffer;
+    req->request_time = std::chrono::steady_clock::now();
+
+    auto& buffer = cap.buffers[req->slot];
+    buffer.dmabuf_offered = false;
+    {
+        std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+        buffer.released = false;
+    }
+    cap.active_buffer = next_frame(cap, cap.active_buffer);
+
+    /* Capture the whole output if the user hasn't provided a good geometry */
+    if (!cap.region.is_selected())
+    {
+        req->frame = zwlr_screencopy_manager_v1_capture_output(
+            screencopy_manager, overlay_cursor, cap.output->output);
+    } else
+    {
+        req->frame = zwlr_screencopy_manager_v1_capture_output_region(
+            screencopy_manager, overlay_cursor, cap.output->output,
+            cap.region.x - cap.output->x,
+            cap.region.y - cap.output->y,
+            cap.region.width, cap.region.height);
+    }
+
+    zwlr_screencopy_frame_v1_add_listener(req->frame, &frame_listener, req.get());
+    cap.requests.push_back(std::move(req));
+}
+
+/* Pipeline statistics are written as JSON lines to --stats if given ("-" for
+ * stderr), otherwise as a summary on stderr */
+static std::string stats_path;
+static std::ofstream stats_file;
+static std::chrono::steady_clock::time_point recording_start;
+
+static void print_stats_json(std::ostream& out, bool final)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - recording_start).count();
+
+    out << "{\"elapsed_sec\":" << elapsed / 1000.0
+        << ",\"final\":" << (final ? "true" : "false")
+        << ",\"paused\":" << (pause_state.paused ? "true" : "false")
+        << ",\"captures\":[";
+    for (size_t i = 0; i < captures.size(); i++)
+    {
+        out << (i ? "," : "");
+        captures[i]->stats.print_json(out, captures[i]->params.file);
+    }
+    out << "]}";
+}
+
+static void dump_stats(bool final)
+{
+    if (stats_path.empty())
+    {
+        for (auto& cap : captures)
+            cap->stats.print_summary(std::cerr, cap->params.file);
+        return;
+    }
+
+    std::ostream& out = (stats_path == "-") ? std::cerr : stats_file;
+    print_stats_json(out, final);
+    out << std::endl;
+}
+
+static int64_t get_monotonic_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_usec(ts);
+}
+
+/* No screencopy requests are sent while paused. Frames still in flight are
+ * skipped, and the paused time is cut from the timestamps of the frames
+ * captured after resuming. */
+static std::string set_paused(bool paused)
+{
+    if (paused == pause_state.paused)
+        return paused ? "error: already paused" : "error: not paused";
+
+    int64_t now = get_monotonic_usec();
+    if (paused)
+    {
+        pause_start_usec = now;
+    } else
+    {
+        pause_state.paused_usec += now - pause_start_usec;
+        pause_state.resume_usec = now;
+    }
+
+    pause_state.paused = paused;
+    return "ok";
+}
+
+/* Apply a change to the encoder of every capture.
+ * Returns the number of encoders, or -1 if one of them rejected it. */
+template<class Change>
+static int change_encoders(Change change)
+{
+    int nr_encoders = 0;
+    for (auto& cap : captures)
     {
-        wo.zxdg_output = zxdg_output_manager_v1_get_xdg_output(
-            xdg_output_manager, wo.output);
-        zxdg_output_v1_add_listener(wo.zxdg_output,
-            &xdg_output_implementation, NULL);
+        std::lock_guard<std::mutex> lock(cap->frame_writer_mutex);
+        if (!cap->frame_writer)
+            continue;
+        if (!change(*cap->frame_writer))
+            return -1;
+        ++nr_encoders;
     }
 
-    sync_wayland();
+    return nr_encoders;
 }
 
-static wf_recorder_output* choose_interactive()
+static std::string handle_control_command(const std::string& line)
 {
-    fprintf(stdout, "Please select an output from the list to capture (enter output no.):\n");
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
 
-    int i = 1;
-    for (auto& wo : available_outputs)
+    if (command == "pause" || command == "resume")
+        return set_paused(command == "pause");
+
+    if (command == "stats")
     {
-        printf("%d. Name: %s Description: %s\n", i++, wo.name.c_str(),
-            wo.description.c_str());
+        std::ostringstream out;
+        print_stats_json(out, false);
+        return out.str();
     }
 
-    printf("Enter output no.:");
-    fflush(stdout);
+    if (command == "stop")
+    {
+        exit_main_loop = true;
+        return "ok";
+    }
 
-    int choice;
-    if (scanf("%d", &choice) != 1 || choice > (int)available_outputs.size() || choice <= 0)
-        return nullptr;
+    int nr_encoders;
+    double value;
+    if (command == "keyframe")
+    {
+        nr_encoders = change_encoders([] (FrameWriter& writer) {
+            writer.force_keyframe();
+            return true;
+        });
+    } else if (command == "bitrate")
+    {
+        if (!(in >> value) || value <= 0)
+            return "error: usage: bitrate <kbit/s>";
+
+        nr_encoders = change_encoders([=] (FrameWriter& writer) {
+            writer.set_bitrate(value * 1000);
+            return true;
+        });
+    } else if (command == "crf")
+    {
+        if (!(in >> value) || value < 0)
+            return "error: usage: crf <value>";
+
+        nr_encoders = change_encoders([=] (FrameWriter& writer) {
+            return writer.set_crf(value);
+        });
+        if (nr_encoders < 0)
+            return "error: the codec has no crf option";
+    } else
+    {
+        return "error: unknown command " + command;
+    }
 
-    return &available_outputs[choice - 1];
+    return nr_encoders > 0 ? "ok" : "error: not encoding";
 }
 
-struct capture_region
+/* Encode a dump made with --raw-dump, as fast as the encoder can */
+static void encode_raw_dump(const std::string& dump_file, FrameWriterParams params)
 {
-    int32_t x, y;
-    int32_t width, height;
-
-    capture_region()
-        : capture_region(0, 0, 0, 0) {}
+    RawDumpReader reader(dump_file);
+    auto layout = reader.get_layout();
 
-    capture_region(int32_t _x, int32_t _y, int32_t _width, int32_t _height)
-        : x(_x), y(_y), width(_width), height(_height) { }
+    params.format = layout.format;
+    params.width = layout.width;
+    params.height = layout.height;
+    params.dmabuf = false;
+    params.enable_audio = false;
 
-    /* Make sure that dimension is even, while trying to keep the segment
-     * [coordinate, coordinate+dimension) as good as possible (i.e not going
-     * out of the monitor) */
-    void make_even(int32_t& coordinate, int32_t& dimension)
+    FrameWriter writer(params);
+    uint64_t i = 0;
+    for (; i < reader.get_nr_frames() && !exit_main_loop; i++)
     {
-        if (dimension % 2 == 0)
-            return;
-
-        /* We need to increase dimension to make it an even number */
-        ++dimension;
-
-        /* Try to decrease coordinate. If coordinate > 0, we can always lower it
-         * by 1 pixel and stay inside the screen. */
-        coordinate = std::max(coordinate - 1, 0);
+        int64_t usec;
+        bool y_invert;
+        auto frame = reader.get_frame(i, usec, y_invert);
+        writer.add_frame(frame, usec, y_invert, {});
     }
 
-    void set_from_string(std::string geometry_string)
+    printf("Encoded %lu frames from %s to %s\n",
+        (unsigned long)i, dump_file.c_str(), params.file.c_str());
+}
+
+/* Parses CPU lists like 0-3,6 */
+static bool parse_cpu_list(const std::string& list, std::vector<int>& cpus)
+{
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < list.size())
     {
-        if (sscanf(geometry_string.c_str(), "%d,%d %dx%d", &x, &y, &width, &height) != 4)
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+
+        int first, last;
+        auto range = list.substr(pos, end - pos);
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) != 2)
         {
-            fprintf(stderr, "Bad geometry: %s, capturing whole output instead.\n",
-                geometry_string.c_str());
-            x = y = width = height = 0;
-            return;
+            if (sscanf(range.c_str(), "%d", &first) != 1)
+                return false;
+            last = first;
         }
 
-        /* ffmpeg requires even width and height */
-        make_even(x, width);
-        make_even(y, height);
-        printf("Adjusted geometry: %d,%d %dx%d\n", x, y, width, height);
-    }
+        if (first < 0 || last < first)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
 
-    bool is_selected()
-    {
-        return width > 0 && height > 0;
+        pos = end + 1;
     }
 
-    bool contained_in(const capture_region& output)
+    return !cpus.empty();
+}
+
+/* recording.mp4 -> recording<suffix>.mp4 */
+static std::string suffixed_file_name(const std::string& file, const std::string& suffix)
+{
+    size_t dot = file.find_last_of('.');
+    size_t slash = file.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return file + suffix;
+
+    return file.substr(0, dot) + suffix + file.substr(dot);
+}
+
+/* recording.mp4 -> recording-2.mp4 */
+static std::string numbered_file_name(const std::string& file, int number)
+{
+    return suffixed_file_name(file, "-" + std::to_string(number));
+}
+
+/* Renditions are named after their height, next to the main file */
+static void set_rendition_files(FrameWriterParams& params)
+{
+    for (auto& rendition : params.renditions)
     {
-        return
-            output.x <= x &&
-            output.x + output.width >= x + width &&
-            output.y <= y &&
-            output.y + output.height >= y + height;
+        rendition.file = suffixed_file_name(params.file,
+            "-" + std::to_string(rendition.height) + "p");
     }
-};
+}
+
+/* Parses WxH[:codec] */
+static bool parse_rendition(const std::string& arg, const FrameWriterParams& params,
+    RenditionParams& rendition)
+{
+    char codec[64] = "";
+    int nr = sscanf(arg.c_str(), "%dx%d:%63s", &rendition.width, &rendition.height, codec);
+    if (nr < 2 || rendition.width <= 0 || rendition.height <= 0)
+        return false;
+
+    /* Chroma is subsampled, keep the sizes even */
+    rendition.width &= ~1;
+    rendition.height &= ~1;
+    rendition.codec = nr == 3 ? codec : params.codec;
+    return rendition.width > 0 && rendition.height > 0;
+}
+
+/* [<source>][@<gain>], an empty source is the default one */
+static bool parse_audio_source(const std::string& arg, AudioSourceParams& source)
+{
+    size_t pos = arg.find('@');
+    source.name = arg.substr(0, pos);
+    source.gain = 1.0f;
+    if (pos == std::string::npos)
+        return true;
+
+    char *end;
+    source.gain = strtof(arg.c_str() + pos + 1, &end);
+    return *end == '\0' && end != arg.c_str() + pos + 1 && source.gain >= 0;
+}
 
 int main(int argc, char *argv[])
 {
     FrameWriterParams params;
     params.file = "recording.mp4";
+    params.streaming = false;
     params.codec = "libx264";
     params.enable_ffmpeg_debug_output = false;
     params.enable_audio = false;
-
-    PulseReaderParams pulseParams;
-
-    std::string cmdline_output = "invalid";
-    capture_region selected_region{};
+    params.audio_tracks = 1;
+    params.damage_hints = false;
+    params.conversion_threads = 0;
+    params.framerate = 0;
+    params.encoder_threads = 0;
+    params.encoder_threading = ENCODER_THREADING_AUTO;
+    params.encoder_slices = 0;
+    params.muxer_queue_size = 64 << 20;
+    params.memory_budget = 0;
+    params.segment_usec = 0;
+    params.segment_size = 0;
+    params.segment_keep = 0;
+    params.scale_source_format = AV_PIX_FMT_NONE;
+    params.scale_source_width = 0;
+    params.scale_source_height = 0;
+    params.stats = NULL;
+    params.on_write_error = request_exit;
+
+    bool muxer_queue_size_set = false;
+    std::vector<int> capture_cpus;
+
+    /* Seconds between periodic statistics dumps, 0 to dump only at exit */
+    int stats_interval = 0;
+
+    std::string control_socket_path;
+
+    AudioMixerParams mixer_params;
+    mixer_params.separate_tracks = false;
+    mixer_params.stats = NULL;
+
+    std::vector<std::string> cmdline_outputs;
+    std::vector<capture_region> selected_regions;
+    std::vector<std::string> encode_dumps;
 
     struct option opts[] = {
         { "output",          required_argument, NULL, 'o' },
@@ -485,13 +1708,39 @@ int main(int argc, char *argv[])
         { "device",          required_argument, NULL, 'd' },
         { "log",             no_argument,       NULL, 'l' },
         { "audio",           optional_argument, NULL, 'a' },
+        { "no-damage",       no_argument,       NULL, 'D' },
+        { "no-dmabuf",       no_argument,       NULL, 'B' },
+        { "conversion-threads", required_argument, NULL, 't' },
+        { "muxer-queue-size", required_argument, NULL, 'q' },
+        { "overload-policy", required_argument, NULL, 'P' },
+        { "framerate",       required_argument, NULL, 'r' },
+        { "stats",           required_argument, NULL, 'S' },
+        { "stats-interval",  required_argument, NULL, 'I' },
+        { "raw-dump",        no_argument,       NULL, 'R' },
+        { "encode-raw",      required_argument, NULL, 'E' },
+        { "segment-time",    required_argument, NULL, 'T' },
+        { "segment-size",    required_argument, NULL, 'M' },
+        { "segment-keep",    required_argument, NULL, 'K' },
+        { "muxer",           required_argument, NULL, 'm' },
+        { "encoder-threads", required_argument, NULL, 'j' },
+        { "encoder-threading", required_argument, NULL, 'J' },
+        { "encoder-slices",  required_argument, NULL, 'L' },
+        { "encoder-cpus",    required_argument, NULL, 'A' },
+        { "capture-cpus",    required_argument, NULL, 'C' },
+        { "capture-depth",   required_argument, NULL, 'n' },
+        { "no-cursor",       no_argument,       NULL, 'X' },
+        { "damage-hints",    no_argument,       NULL, 'H' },
+        { "rendition",       required_argument, NULL, 'W' },
+        { "audio-tracks",    no_argument,       NULL, 'Y' },
+        { "control-socket",  required_argument, NULL, 's' },
+        { "memory-budget",   required_argument, NULL, 'b' },
         { 0,                 0,                 NULL,  0  }
     };
 
     int c, i;
     std::string param;
     size_t pos;
-    while((c = getopt_long(argc, argv, "o:f:g:c:p:d:la::", opts, &i)) != -1)
+    while((c = getopt_long(argc, argv, "o:f:g:c:p:d:la::Dt:Bq:P:r:S:I:RE:T:M:K:m:j:J:L:A:C:n:XHW:Ys:b:", opts, &i)) != -1)
     {
         switch(c)
         {
@@ -500,11 +1749,14 @@ int main(int argc, char *argv[])
                 break;
 
             case 'o':
-                cmdline_output = optarg;
+                cmdline_outputs.push_back(optarg);
                 break;
 
             case 'g':
-                selected_region.set_from_string(optarg);
+                selected_regions.emplace_back();
+                selected_regions.back().set_from_string(optarg);
+                if (!selected_regions.back().is_selected())
+                    selected_regions.pop_back();
                 break;
 
             case 'c':
@@ -521,7 +1773,145 @@ int main(int argc, char *argv[])
 
             case 'a':
                 params.enable_audio = true;
-                pulseParams.audio_source = optarg ? strdup(optarg) : NULL;
+                mixer_params.sources.emplace_back();
+                if (!parse_audio_source(optarg ?: "", mixer_params.sources.back()))
+                {
+                    printf("Invalid audio source %s\n", optarg);
+                    mixer_params.sources.pop_back();
+                }
+                break;
+
+            case 'Y':
+                mixer_params.separate_tracks = true;
+                break;
+
+            case 's':
+                control_socket_path = optarg;
+                break;
+
+            case 'D':
+                use_damage = false;
+                break;
+
+            case 'q':
+                params.muxer_queue_size = (size_t)std::max(1, atoi(optarg)) << 20;
+                muxer_queue_size_set = true;
+                break;
+
+            case 'm':
+                params.muxer = optarg;
+                break;
+
+            case 'j':
+                params.encoder_threads = atoi(optarg);
+                if (params.encoder_threads < 1 || params.encoder_threads > MAX_ENCODER_THREADS)
+                {
+                    printf("Invalid number of encoder threads %s\n", optarg);
+                    params.encoder_threads = 0;
+                }
+                break;
+
+            case 'J':
+                if (!strcmp(optarg, "auto"))
+                    params.encoder_threading = ENCODER_THREADING_AUTO;
+                else if (!strcmp(optarg, "frame"))
+                    params.encoder_threading = ENCODER_THREADING_FRAME;
+                else if (!strcmp(optarg, "slice"))
+                    params.encoder_threading = ENCODER_THREADING_SLICE;
+                else
+                    printf("Invalid encoder threading %s\n", optarg);
+                break;
+
+            case 'L':
+                params.encoder_slices = std::max(0, atoi(optarg));
+                break;
+
+            case 'A':
+                if (!parse_cpu_list(optarg, params.encoder_cpus))
+                    printf("Invalid CPU list %s\n", optarg);
+                break;
+
+            case 'W':
+                params.renditions.emplace_back();
+                if (!parse_rendition(optarg, params, params.renditions.back()))
+                {
+                    printf("Invalid rendition %s\n", optarg);
+                    params.renditions.pop_back();
+                }
+                break;
+
+            case 'H':
+                params.damage_hints = true;
+                break;
+
+            case 'X':
+                overlay_cursor = false;
+                break;
+
+            case 'n':
+                capture_depth = std::max(1, std::min(MAX_CAPTURE_DEPTH, atoi(optarg)));
+                break;
+
+            case 'b':
+                memory_budget = (size_t)std::max(0, atoi(optarg)) << 20;
+                break;
+
+            case 'C':
+                if (!parse_cpu_list(optarg, capture_cpus))
+                    printf("Invalid CPU list %s\n", optarg);
+                break;
+
+            case 'r':
+                params.framerate = std::max(0, atoi(optarg));
+                break;
+
+            case 'S':
+                stats_path = optarg;
+                break;
+
+            case 'I':
+                stats_interval = std::max(0, atoi(optarg));
+                break;
+
+            case 'R':
+                raw_dump = true;
+                break;
+
+            case 'E':
+                encode_dumps.push_back(optarg);
+                break;
+
+            case 'T':
+                params.segment_usec = (int64_t)std::max(0, atoi(optarg)) * 1000000;
+                break;
+
+            case 'M':
+                params.segment_size = (size_t)std::max(0, atoi(optarg)) << 20;
+                break;
+
+            case 'K':
+                params.segment_keep = std::max(0, atoi(optarg));
+                break;
+
+            case 'P':
+                if (!strcmp(optarg, "block"))
+                    overload = OVERLOAD_BLOCK;
+                else if (!strcmp(optarg, "drop-oldest"))
+                    overload = OVERLOAD_DROP_OLDEST;
+                else if (!strcmp(optarg, "drop-newest"))
+                    overload = OVERLOAD_DROP_NEWEST;
+                else if (!strcmp(optarg, "throttle"))
+                    overload = OVERLOAD_THROTTLE;
+                else
+                    printf("Invalid overload policy %s\n", optarg);
+                break;
+
+            case 'B':
+                use_dmabuf = false;
+                break;
+
+            case 't':
+                params.conversion_threads = std::max(1, atoi(optarg));
                 break;
 
             case 'p':
@@ -543,6 +1933,97 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Renditions with the same codec take the same codec options */
+    for (auto& rendition : params.renditions)
+    {
+        if (rendition.codec == params.codec)
+            rendition.codec_options = params.codec_options;
+    }
+
+    /* Keep the encoders off the CPUs reserved for the capture, so that it
+     * isn't delayed by them */
+    if (!capture_cpus.empty())
+    {
+        if (params.encoder_cpus.empty())
+        {
+            for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++)
+            {
+                if (std::find(capture_cpus.begin(), capture_cpus.end(), cpu) == capture_cpus.end())
+                    params.encoder_cpus.push_back(cpu);
+            }
+        }
+
+        if (!set_thread_affinity(capture_cpus))
+            std::cerr << "Failed to set the CPU affinity of the capture" << std::endl;
+    }
+
+    /* e.g udp://, srt:// or rtmp:// */
+    params.streaming = params.file.find("://") != std::string::npos;
+    if (params.streaming)
+    {
+        if (raw_dump || !encode_dumps.empty() || !params.renditions.empty() ||
+            cmdline_outputs.size() > 1 || selected_regions.size() > 1)
+        {
+            std::cerr << "Streaming supports a single capture only" << std::endl;
+            std::exit(-1);
+        }
+
+        if (params.segment_usec || params.segment_size)
+        {
+            std::cerr << "Segments can't be used when streaming, ignoring" << std::endl;
+            params.segment_usec = 0;
+            params.segment_size = 0;
+        }
+
+        if (params.muxer.empty())
+            params.muxer = params.file.compare(0, 4, "rtmp") ? "mpegts" : "flv";
+
+        /* A smaller queue drops packets sooner instead of building up delay */
+        if (!muxer_queue_size_set)
+            params.muxer_queue_size = STREAM_MUXER_QUEUE_SIZE;
+
+        if (params.codec == "libx264" && !params.codec_options.count("tune"))
+            params.codec_options["tune"] = "zerolatency";
+    }
+
+    /* Encoding dumps doesn't need the compositor. Several dumps are encoded
+     * in parallel, into numbered files. */
+    if (!encode_dumps.empty())
+    {
+        if (params.conversion_threads == 0)
+            params.conversion_threads = 1;
+
+        std::vector<std::thread> encoders;
+        for (size_t i = 0; i < encode_dumps.size(); i++)
+        {
+            auto dump_params = params;
+            if (encode_dumps.size() > 1)
+                dump_params.file = numbered_file_name(params.file, i + 1);
+            set_rendition_files(dump_params);
+
+            auto dump_file = encode_dumps[i];
+            encoders.emplace_back([=] () {
+                encode_raw_dump(dump_file, dump_params);
+            });
+        }
+
+        for (auto& encoder : encoders)
+            encoder.join();
+
+        return EXIT_SUCCESS;
+    }
+
+    if (raw_dump && params.enable_audio)
+    {
+        fprintf(stderr, "audio can't be recorded into raw dumps, disabling it\n");
+        params.enable_audio = false;
+    }
+
+    if (mixer_params.sources.empty())
+        params.enable_audio = false;
+    if (params.enable_audio && mixer_params.separate_tracks)
+        params.audio_tracks = mixer_params.sources.size();
+
     display = wl_display_connect(NULL);
     if (display == NULL) {
         fprintf(stderr, "failed to create display: %m\n");
@@ -556,125 +2037,304 @@ int main(int argc, char *argv[])
     check_has_protos();
     load_output_info();
 
-    wf_recorder_output *chosen_output = nullptr;
+    /* The dmabufs have to be allocated on the GPU which encodes them */
+    bool vaapi = params.codec.find("vaapi") != std::string::npos;
+    if (vaapi && params.hw_device.empty())
+        params.hw_device = DEFAULT_RENDER_NODE;
+
+    /* Raw dumps need to read the pixels, so they stay in shared memory */
+    if (use_dmabuf && !raw_dump && vaapi)
+        init_gbm_device(params.hw_device);
+
+    std::vector<wf_recorder_output*> chosen_outputs;
     if (available_outputs.size() == 1)
     {
-        chosen_output = &available_outputs[0];
+        chosen_outputs.push_back(&available_outputs[0]);
     } else
     {
-        for (auto& wo : available_outputs)
+        for (auto& name : cmdline_outputs)
+        {
+            bool found = false;
+            for (auto& wo : available_outputs)
+            {
+                if (wo.name == name)
+                {
+                    chosen_outputs.push_back(&wo);
+                    found = true;
+                }
+            }
+
+            if (!found)
+                fprintf(stderr, "Couldn't find requested output %s\n", name.c_str());
+        }
+
+        if (chosen_outputs.empty())
         {
-            if (wo.name == cmdline_output)
-                chosen_output = &wo;
+            auto chosen_output = choose_interactive();
+            if (chosen_output)
+                chosen_outputs.push_back(chosen_output);
         }
+    }
+
+    if (chosen_outputs.empty())
+    {
+        fprintf(stderr, "Failed to select output, exiting\n");
+        return EXIT_FAILURE;
+    }
 
-        if (chosen_output == NULL)
+    /* Each region is captured from the chosen output which contains it.
+     * Without regions, every chosen output is captured as a whole. */
+    for (auto& region : selected_regions)
+    {
+        wf_recorder_output *region_output = nullptr;
+        for (auto& wo : chosen_outputs)
         {
-            if (cmdline_output != "invalid")
+            if (region.contained_in({wo->x, wo->y, wo->width, wo->height}))
             {
-                fprintf(stderr, "Couldn't find requested output %s\n",
-                    cmdline_output.c_str());
+                region_output = wo;
+                break;
             }
+        }
 
-            chosen_output = choose_interactive();
+        if (!region_output)
+        {
+            fprintf(stderr, "Invalid region to capture %d,%d %dx%d: must be "
+                "completely inside the output\n",
+                region.x, region.y, region.width, region.height);
+            continue;
         }
+
+        captures.emplace_back(new wf_capture);
+        captures.back()->output = region_output;
+        captures.back()->region = region;
     }
 
+    if (captures.empty())
+    {
+        for (auto& wo : chosen_outputs)
+        {
+            captures.emplace_back(new wf_capture);
+            captures.back()->output = wo;
+        }
+    }
 
-    if (chosen_output == nullptr)
+    /* With several captures, the conversion slices of all encoders share one
+     * pool of threads instead of each encoder starting its own. libavcodec
+     * can't be given a pool, so the encoders still start their own threads,
+     * and split the cores between them by default instead. */
+    int nr_cores = std::max(1u, std::thread::hardware_concurrency());
+    if (captures.size() > 1)
     {
-        fprintf(stderr, "Failed to select output, exiting\n");
-        return EXIT_FAILURE;
+        /* Created by the capture thread, which may be pinned already */
+        params.conversion_pool = std::make_shared<ThreadPool>(nr_cores, params.encoder_cpus);
+        if (params.conversion_threads == 0)
+            params.conversion_threads = std::max<int>(1, nr_cores / captures.size());
+        if (params.encoder_threads == 0)
+            params.encoder_threads = std::max<int>(1, nr_cores / captures.size());
     }
 
-    if (selected_region.is_selected())
+    if (params.conversion_threads == 0)
+        params.conversion_threads = 1;
+
+    for (size_t i = 0; i < captures.size(); i++)
     {
-        if (!selected_region.contained_in({chosen_output->x, chosen_output->y,
-            chosen_output->width, chosen_output->height}))
+        auto& cap = *captures[i];
+        cap.params = params;
+        cap.params.stats = &cap.stats;
+        cap.mixer_params = mixer_params;
+
+        /* Audio is recorded only once, together with the first capture */
+        if (i > 0)
+            cap.params.enable_audio = false;
+        if (captures.size() > 1)
+            cap.params.file = numbered_file_name(params.file, i + 1);
+        set_rendition_files(cap.params);
+
+        printf("capturing %s region %d %d %d %d to %s\n", cap.output->name.c_str(),
+            cap.region.x, cap.region.y, cap.region.width, cap.region.height,
+            cap.params.file.c_str());
+
+        for (size_t j = 0; j < MAX_BUFFERS; j++)
         {
-            fprintf(stderr, "Invalid region to capture: must be completely "
-                "inside the output\n");
-            selected_region = capture_region{};
+            cap.buffers[j].wl_buffer = NULL;
+            cap.buffers[j].pool_chunk = j;
         }
     }
 
-    printf("selected region %d %d %d %d\n", selected_region.x, selected_region.y, selected_region.width, selected_region.height);
-
+    /* All captures are timestamped relative to the first frame of any of
+     * them, so that the recordings stay aligned */
     timespec first_frame;
     first_frame.tv_sec = -1;
 
-    active_buffer = 0;
-    for (auto& buffer : buffers)
+    if (!stats_path.empty() && stats_path != "-")
     {
-        buffer.wl_buffer = NULL;
-        buffer.available = false;
-        buffer.released = true;
+        stats_file.open(stats_path);
+        if (!stats_file)
+        {
+            fprintf(stderr, "failed to open %s for the statistics, "
+                "printing them to stderr\n", stats_path.c_str());
+            stats_path = "-";
+        }
     }
 
-    bool spawned_thread = false;
-    std::thread writer_thread;
+    recording_start = std::chrono::steady_clock::now();
+    auto next_stats_dump = recording_start + std::chrono::seconds(stats_interval);
+
+    if (!control_socket_path.empty())
+    {
+        control_socket = std::unique_ptr<ControlSocket> (
+            new ControlSocket(control_socket_path, handle_control_command));
+    }
+
+    capture_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (capture_wakeup_fd < 0)
+    {
+        fprintf(stderr, "failed to create an eventfd: %m\n");
+        return EXIT_FAILURE;
+    }
 
     signal(SIGINT, handle_sigint);
 
     while(!exit_main_loop)
     {
-        // wait for a free buffer
-        while(buffers[active_buffer].released != true) {
-            std::this_thread::sleep_for(std::chrono::microseconds(500));
-        }
+        /* Send a screencopy request for every capture which is due */
+        int timeout_ms = -1;
+        auto now = std::chrono::steady_clock::now();
 
-        buffer_copy_done = false;
-        struct zwlr_screencopy_frame_v1 *frame = NULL;
-
-        /* Capture the whole output if the user hasn't provided a good geometry */
-        if (!selected_region.is_selected())
-        {
-            frame = zwlr_screencopy_manager_v1_capture_output(
-                screencopy_manager, 1, chosen_output->output);
-        } else
+        if (stats_interval > 0)
         {
-            frame = zwlr_screencopy_manager_v1_capture_output_region(
-                screencopy_manager, 1, chosen_output->output,
-                selected_region.x - chosen_output->x,
-                selected_region.y - chosen_output->y,
-                selected_region.width, selected_region.height);
+            if (now >= next_stats_dump)
+            {
+                dump_stats(false);
+                next_stats_dump = now + std::chrono::seconds(stats_interval);
+            }
+
+            timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                next_stats_dump - now).count() + 1;
         }
+        for (auto& c : captures)
+        {
+            auto& cap = *c;
+            while ((int)cap.requests.size() < capture_depth && !exit_main_loop &&
+                !pause_state.paused)
+            {
+                if (now < cap.next_capture)
+                {
+                    int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        cap.next_capture - now).count() + 1;
+                    timeout_ms = timeout_ms < 0 ? wait_ms : std::min(timeout_ms, wait_ms);
+                    break;
+                }
 
-        zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
+                if (!acquire_capture_buffer(cap))
+                    break;
 
-        while (!buffer_copy_done && wl_display_dispatch(display) != -1) {
-            // This space is intentionally left blank
+                /* Only once a buffer is there, so that waiting for the
+                 * writer doesn't push the next capture further out */
+                if (params.framerate > 0)
+                    limit_framerate(cap, params.framerate);
+
+                start_capture(cap);
+            }
         }
 
-        auto& buffer = buffers[active_buffer];
-        //std::cout << "first buffer at " << timespec_to_usec(get_ct()) / 1.0e6<< std::endl;
+        if (exit_main_loop || dispatch_wayland_events(timeout_ms) == -1)
+            break;
 
-        if (!spawned_thread)
+        for (auto& c : captures)
         {
-            writer_thread = std::thread([=] () {
-                write_loop(params, pulseParams);
-            });
-
-            spawned_thread = true;
+            auto& cap = *c;
+            while (!cap.requests.empty() && cap.requests.front()->done)
+            {
+                auto req = std::move(cap.requests.front());
+                cap.requests.pop_front();
+                zwlr_screencopy_frame_v1_destroy(req->frame);
+
+                auto& buffer = cap.buffers[req->slot];
+                if (first_frame.tv_sec == -1)
+                    first_frame = buffer.presented;
+
+                /* Presentation times are on CLOCK_MONOTONIC, like the
+                 * timestamps of the audio */
+                if (cap.clock_origin_usec < 0)
+                    cap.clock_origin_usec = timespec_to_usec(first_frame);
+
+                /* Compositors may complete all pending requests with the same
+                 * frame, which doesn't need to be encoded twice */
+                bool duplicate = cap.last_presented.tv_sec != 0 &&
+                    timespec_to_usec(buffer.presented) <= timespec_to_usec(cap.last_presented);
+                if (duplicate)
+                    ++cap.duplicate_frames;
+                else
+                    cap.last_presented = buffer.presented;
+
+                buffer.base_usec = timespec_to_usec(buffer.presented)
+                    - timespec_to_usec(first_frame) - pause_state.paused_usec;
+
+                buffer.queued_time = std::chrono::steady_clock::now();
+                cap.stats.handoff.record_since(buffer.ready_time);
+                set_buffer_available(cap, buffer, duplicate || pause_state.paused ||
+                    is_unusable_dmabuf(cap, buffer));
+
+                if (overload == OVERLOAD_THROTTLE && cap.writer_ready)
+                    throttle_capture(cap);
+            }
         }
+    }
 
-        if (first_frame.tv_sec == -1)
-            first_frame = buffer.presented;
-
-        buffer.base_usec = timespec_to_usec(buffer.presented)
-            - timespec_to_usec(first_frame);
+    for (auto& c : captures)
+    {
+        auto& cap = *c;
 
-        buffer.released = false;
-        buffer.available = true;
+        /* Interrupted while waiting for the frames */
+        for (auto& req : cap.requests)
+            zwlr_screencopy_frame_v1_destroy(req->frame);
+        cap.requests.clear();
 
-        active_buffer = next_frame(active_buffer);
-        zwlr_screencopy_frame_v1_destroy(frame);
+        /* Wake up the writer thread in case it is waiting for a new frame.
+         * exit_main_loop is set without the lock, from the signal handler
+         * or a control command, so taking it here makes sure the writer
+         * thread either sees the flag or is already waiting. */
+        {
+            std::lock_guard<std::mutex> lock(cap.buffers_mutex);
+            cap.buffer_available_cv.notify_all();
+        }
+        if (cap.writer_thread.joinable())
+            cap.writer_thread.join();
+        if (cap.prefault_thread.joinable())
+            cap.prefault_thread.join();
+
+        if (overload == OVERLOAD_DROP_OLDEST || overload == OVERLOAD_DROP_NEWEST)
+            printf("%s: dropped %lu frames\n", cap.params.file.c_str(),
+                (unsigned long)cap.dropped_frames);
+        if (cap.duplicate_frames)
+            printf("%s: skipped %lu duplicate frames\n", cap.params.file.c_str(),
+                (unsigned long)cap.duplicate_frames);
+        if (overload == OVERLOAD_THROTTLE)
+            printf("%s: longest delay between captures: %ldms\n",
+                cap.params.file.c_str(), (long)(cap.peak_throttle_usec / 1000));
+
+        for (auto& buffer : cap.buffers)
+        {
+            if (buffer.bo)
+                destroy_dmabuf_buffer(buffer);
+            else if (buffer.wl_buffer)
+                wl_buffer_destroy(buffer.wl_buffer);
+            buffer.pool = nullptr;
+        }
     }
 
-    writer_thread.join();
+    dump_stats(true);
+    control_socket = nullptr;
+    captures.clear();
+    close(capture_wakeup_fd);
+    params.conversion_pool = nullptr;
 
-    for (auto& buffer : buffers)
-        wl_buffer_destroy(buffer.wl_buffer);
+    if (gbm_device)
+    {
+        gbm_device_destroy(gbm_device);
+        close(gbm_device_fd);
+    }
 
     return EXIT_SUCCESS;
 }
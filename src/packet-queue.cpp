@@ -0,0 +1,91 @@
+#include "packet-queue.hpp"
+#include <algorithm>
+
+PacketQueue::PacketQueue(size_t _max_bytes)
+    : max_bytes(_max_bytes)
+{
+}
+
+PacketQueue::~PacketQueue()
+{
+    for (auto& pkt : packets)
+        av_packet_free(&pkt);
+}
+
+void PacketQueue::push(AVPacket *pkt)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [=] () {
+            return packets.empty() || queued_bytes + pkt->size <= max_bytes;
+        });
+
+        packets.push_back(pkt);
+        queued_bytes += pkt->size;
+        peak_bytes = std::max(peak_bytes, queued_bytes);
+    }
+
+    not_empty.notify_one();
+}
+
+bool PacketQueue::try_push(AVPacket *pkt)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!packets.empty() && queued_bytes + pkt->size > max_bytes)
+            return false;
+
+        packets.push_back(pkt);
+        queued_bytes += pkt->size;
+        peak_bytes = std::max(peak_bytes, queued_bytes);
+    }
+
+    not_empty.notify_one();
+    return true;
+}
+
+AVPacket *PacketQueue::pop()
+{
+    AVPacket *pkt;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [=] () { return closed || !packets.empty(); });
+        if (packets.empty())
+            return NULL;
+
+        pkt = packets.front();
+        packets.pop_front();
+        queued_bytes -= pkt->size;
+    }
+
+    not_full.notify_all();
+    return pkt;
+}
+
+void PacketQueue::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+
+    not_empty.notify_all();
+}
+
+size_t PacketQueue::get_nr_packets()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return packets.size();
+}
+
+size_t PacketQueue::get_queued_bytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued_bytes;
+}
+
+size_t PacketQueue::get_peak_bytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak_bytes;
+}
@@ -0,0 +1,50 @@
+#ifndef PACKET_QUEUE_HPP
+#define PACKET_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+/* A queue of encoded packets waiting to be muxed, bounded by the total size
+ * of the packet data */
+class PacketQueue
+{
+    std::deque<AVPacket*> packets;
+    size_t max_bytes;
+    size_t queued_bytes = 0;
+    size_t peak_bytes = 0;
+    bool closed = false;
+
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+
+    public:
+    PacketQueue(size_t max_bytes);
+    ~PacketQueue();
+
+    /* Takes ownership of the packet. Blocks while the queue is full, unless it
+     * is empty, so that packets bigger than the limit still go through. */
+    void push(AVPacket *pkt);
+
+    /* Like push(), but returns false instead of blocking if the queue is
+     * full. The packet stays owned by the caller in that case. */
+    bool try_push(AVPacket *pkt);
+
+    /* Blocks until a packet is available.
+     * Returns NULL once the queue has been closed and drained. */
+    AVPacket *pop();
+
+    /* Wake up the consumer, no more packets will be pushed */
+    void close();
+
+    size_t get_nr_packets();
+    size_t get_queued_bytes();
+    size_t get_peak_bytes();
+};
+
+#endif /* end of include guard: PACKET_QUEUE_HPP */
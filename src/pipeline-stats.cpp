@@ -0,0 +1,233 @@
+#include "pipeline-stats.hpp"
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+    for (auto& bucket : buckets)
+        bucket = 0;
+}
+
+void LatencyHistogram::record(uint64_t usec)
+{
+    int bucket = 0;
+    while (bucket < NR_BUCKETS - 1 && (usec >> bucket))
+        ++bucket;
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_usec.fetch_add(usec, std::memory_order_relaxed);
+
+    uint64_t max = max_usec.load(std::memory_order_relaxed);
+    while (usec > max && !max_usec.compare_exchange_weak(max, usec,
+            std::memory_order_relaxed)) {
+        // Retry with the updated max
+    }
+}
+
+void LatencyHistogram::record_since(std::chrono::steady_clock::time_point start)
+{
+    record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+uint64_t LatencyHistogram::get_count() const
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::get_mean_usec() const
+{
+    uint64_t n = get_count();
+    return n ? total_usec.load(std::memory_order_relaxed) / n : 0;
+}
+
+uint64_t LatencyHistogram::get_max_usec() const
+{
+    return max_usec.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::get_percentile_usec(double fraction) const
+{
+    uint64_t n = get_count();
+    if (n == 0)
+        return 0;
+
+    uint64_t target = std::max<uint64_t>(1, fraction * n);
+    uint64_t seen = 0;
+    for (int i = 0; i < NR_BUCKETS; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return std::min<uint64_t>((1ull << i) - 1, get_max_usec());
+    }
+
+    return get_max_usec();
+}
+
+void LatencyHistogram::print_summary(std::ostream& out) const
+{
+    out << "n=" << get_count()
+        << " mean=" << get_mean_usec() << "us"
+        << " p50<=" << get_percentile_usec(0.5) << "us"
+        << " p99<=" << get_percentile_usec(0.99) << "us"
+        << " max=" << get_max_usec() << "us";
+}
+
+void LatencyHistogram::print_json(std::ostream& out) const
+{
+    out << "{\"count\":" << get_count()
+        << ",\"mean_usec\":" << get_mean_usec()
+        << ",\"p50_usec\":" << get_percentile_usec(0.5)
+        << ",\"p90_usec\":" << get_percentile_usec(0.9)
+        << ",\"p99_usec\":" << get_percentile_usec(0.99)
+        << ",\"max_usec\":" << get_max_usec()
+        << ",\"buckets\":[";
+
+    /* Trailing empty buckets are left out */
+    int last = NR_BUCKETS - 1;
+    while (last > 0 && buckets[last].load(std::memory_order_relaxed) == 0)
+        --last;
+
+    for (int i = 0; i <= last; i++)
+        out << (i ? "," : "") << buckets[i].load(std::memory_order_relaxed);
+    out << "]}";
+}
+
+std::vector<std::pair<const char*, const LatencyHistogram*>>
+PipelineStats::get_stages() const
+{
+    return {
+        {"capture", &capture},
+        {"handoff", &handoff},
+        {"queue_wait", &queue_wait},
+        {"convert", &convert},
+        {"encode", &encode},
+        {"mux", &mux},
+    };
+}
+
+void PoolUsage::set_limit(uint64_t bytes)
+{
+    limit_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+void PoolUsage::set_used(uint64_t bytes)
+{
+    used_bytes.store(bytes, std::memory_order_relaxed);
+
+    uint64_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !peak_bytes.compare_exchange_weak(peak, bytes,
+            std::memory_order_relaxed)) {
+        // Retry with the updated peak
+    }
+}
+
+uint64_t PoolUsage::get_limit() const
+{
+    return limit_bytes.load(std::memory_order_relaxed);
+}
+
+uint64_t PoolUsage::get_used() const
+{
+    return used_bytes.load(std::memory_order_relaxed);
+}
+
+uint64_t PoolUsage::get_peak() const
+{
+    return peak_bytes.load(std::memory_order_relaxed);
+}
+
+void PoolUsage::print_summary(std::ostream& out) const
+{
+    out << "limit=" << get_limit() / 1024 << "KiB"
+        << " used=" << get_used() / 1024 << "KiB"
+        << " peak=" << get_peak() / 1024 << "KiB";
+}
+
+void PoolUsage::print_json(std::ostream& out) const
+{
+    out << "{\"limit_bytes\":" << get_limit()
+        << ",\"used_bytes\":" << get_used()
+        << ",\"peak_bytes\":" << get_peak() << "}";
+}
+
+std::vector<std::pair<const char*, const PoolUsage*>>
+PipelineStats::get_pools() const
+{
+    return {
+        {"capture_ring", &capture_ring},
+        {"muxer_queue", &muxer_queue},
+        {"hw_surfaces", &hw_surfaces},
+        {"audio_ring", &audio_ring},
+    };
+}
+
+void PipelineStats::print_summary(std::ostream& out, const std::string& name) const
+{
+    for (auto& stage : get_stages())
+    {
+        out << name << " " << stage.first << ": ";
+        stage.second->print_summary(out);
+        out << "\n";
+    }
+
+    for (auto& pool : get_pools())
+    {
+        if (!pool.second->get_limit() && !pool.second->get_peak())
+            continue;
+
+        out << name << " " << pool.first << " memory: ";
+        pool.second->print_summary(out);
+        out << "\n";
+    }
+
+    if (audio_ring.get_limit())
+    {
+        out << name << " audio: overruns=" << audio_overruns
+            << " underruns=" << audio_underruns << "\n";
+    }
+
+    out.flush();
+}
+
+/* Output file names are the only strings, escape what JSON requires */
+static void print_json_string(std::ostream& out, const std::string& str)
+{
+    out << '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if ((unsigned char)c < 0x20)
+            out << ' ';
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+void PipelineStats::print_json(std::ostream& out, const std::string& name) const
+{
+    out << "{\"name\":";
+    print_json_string(out, name);
+
+    for (auto& stage : get_stages())
+    {
+        out << ",\"" << stage.first << "\":";
+        stage.second->print_json(out);
+    }
+
+    out << ",\"audio\":{\"overruns\":" << audio_overruns
+        << ",\"underruns\":" << audio_underruns << "}";
+
+    out << ",\"memory\":{";
+    bool first = true;
+    for (auto& pool : get_pools())
+    {
+        out << (first ? "" : ",") << "\"" << pool.first << "\":";
+        pool.second->print_json(out);
+        first = false;
+    }
+
+    out << "}}";
+}
@@ -0,0 +1,103 @@
+#ifndef PIPELINE_STATS_HPP
+#define PIPELINE_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+/* A histogram of durations with power of two buckets. Recording is a few
+ * relaxed atomic increments, so it can be done from any thread on every
+ * frame and read concurrently. */
+class LatencyHistogram
+{
+    /* Bucket i counts durations of [2^(i-1), 2^i) microseconds,
+     * bucket 0 counts durations under 1us */
+    static const int NR_BUCKETS = 32;
+    std::atomic<uint64_t> buckets[NR_BUCKETS];
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_usec{0};
+    std::atomic<uint64_t> max_usec{0};
+
+    public:
+    LatencyHistogram();
+
+    void record(uint64_t usec);
+    void record_since(std::chrono::steady_clock::time_point start);
+
+    uint64_t get_count() const;
+    uint64_t get_mean_usec() const;
+    uint64_t get_max_usec() const;
+    /* Upper bound of the bucket containing the given fraction of samples */
+    uint64_t get_percentile_usec(double fraction) const;
+
+    void print_summary(std::ostream& out) const;
+    void print_json(std::ostream& out) const;
+};
+
+/* Bytes held by one buffer pool. Updated by the owner of the pool, and read
+ * concurrently like the histograms. */
+class PoolUsage
+{
+    std::atomic<uint64_t> limit_bytes{0};
+    std::atomic<uint64_t> used_bytes{0};
+    std::atomic<uint64_t> peak_bytes{0};
+
+    public:
+    /* The most the pool may hold, or what it allocated up front */
+    void set_limit(uint64_t bytes);
+    void set_used(uint64_t bytes);
+
+    uint64_t get_limit() const;
+    uint64_t get_used() const;
+    uint64_t get_peak() const;
+
+    void print_summary(std::ostream& out) const;
+    void print_json(std::ostream& out) const;
+};
+
+/* Time spent by frames in each stage of the pipeline of one capture, and the
+ * memory held by its buffers */
+struct PipelineStats
+{
+    /* From the screencopy request to frame_handle_ready */
+    LatencyHistogram capture;
+    /* From frame_handle_ready to handing the buffer to the writer thread */
+    LatencyHistogram handoff;
+    /* Waiting for the writer thread to pick up the buffer */
+    LatencyHistogram queue_wait;
+    /* Colorspace conversion, hw upload or dmabuf import */
+    LatencyHistogram convert;
+    /* Sending a video frame to the encoder and receiving its packets */
+    LatencyHistogram encode;
+    /* Writing a packet of any stream, av_write_frame when streaming and
+     * av_interleaved_write_frame otherwise */
+    LatencyHistogram mux;
+
+    /* The shm or dmabuf buffers of the capture ring */
+    PoolUsage capture_ring;
+    /* Encoded packets waiting to be written */
+    PoolUsage muxer_queue;
+    /* Surfaces of a fixed-size hw frame pool */
+    PoolUsage hw_surfaces;
+    /* Captured audio waiting to be mixed, summed over the sources */
+    PoolUsage audio_ring;
+
+    /* Audio reads dropped because the ring was full, and frames mixed
+     * without a source because it had nothing captured yet */
+    std::atomic<uint64_t> audio_overruns{0};
+    std::atomic<uint64_t> audio_underruns{0};
+
+    std::vector<std::pair<const char*, const LatencyHistogram*>> get_stages() const;
+    std::vector<std::pair<const char*, const PoolUsage*>> get_pools() const;
+
+    /* One line per stage and per pool in use */
+    void print_summary(std::ostream& out, const std::string& name) const;
+    /* A single JSON object */
+    void print_json(std::ostream& out, const std::string& name) const;
+};
+
+#endif /* end of include guard: PIPELINE_STATS_HPP */
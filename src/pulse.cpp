@@ -3,69 +3,283 @@
 #include <iostream>
 #include <vector>
 #include <cstring>
-#include <thread>
+#include <time.h>
+
+/* How many audio frames the ring can hold before reads are dropped */
+#define AUDIO_RING_FRAMES 16
+/* Chunks are usually half a frame. If there are more, the timestamps of
+ * the extra ones are dropped and extrapolated from the previous chunk. */
+#define AUDIO_RING_TIMESTAMPS 256
+
+#define AUDIO_BYTES_PER_SECOND (AUDIO_RATE * 2 * sizeof(float))
+
+static int64_t get_monotonic_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
 
 PulseReader::PulseReader(PulseReaderParams _p)
-    : params(_p)
+    : params(_p), ring(_p.audio_frame_size * AUDIO_RING_FRAMES),
+    timestamps(sizeof(AudioTimestamp) * AUDIO_RING_TIMESTAMPS)
+{
+    std::cout << "Using PulseAudio device: " << (params.audio_source ?: "default") << std::endl;
+    if (!connect())
+    {
+        std::cerr << "Failed to connect to PulseAudio: "
+            << pa_strerror(context ? pa_context_errno(context) : 0)
+            << "\nRecording won't have audio from "
+            << (params.audio_source ?: "default") << std::endl;
+
+        if (mainloop)
+            pa_threaded_mainloop_stop(mainloop);
+        if (stream)
+            pa_stream_unref(stream);
+        if (context)
+            pa_context_unref(context);
+        if (mainloop)
+            pa_threaded_mainloop_free(mainloop);
+
+        stream = NULL;
+        context = NULL;
+        mainloop = NULL;
+    }
+}
+
+void PulseReader::context_state_cb(pa_context *, void *data)
+{
+    pa_threaded_mainloop_signal(((PulseReader*)data)->mainloop, 0);
+}
+
+void PulseReader::stream_state_cb(pa_stream *, void *data)
+{
+    pa_threaded_mainloop_signal(((PulseReader*)data)->mainloop, 0);
+}
+
+void PulseReader::stream_read_cb(pa_stream *, size_t, void *data)
+{
+    ((PulseReader*)data)->read_available();
+}
+
+/* Connects to the server and starts recording, the samples arrive in
+ * stream_read_cb() from then on */
+bool PulseReader::connect()
 {
+    mainloop = pa_threaded_mainloop_new();
+    if (!mainloop)
+        return false;
+
+    context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "wf-recorder3");
+    if (!context)
+        return false;
+
+    pa_context_set_state_callback(context, context_state_cb, this);
+    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(mainloop) < 0)
+    {
+        return false;
+    }
+
+    pa_threaded_mainloop_lock(mainloop);
+    pa_context_state_t context_state;
+    while ((context_state = pa_context_get_state(context)) != PA_CONTEXT_READY)
+    {
+        if (!PA_CONTEXT_IS_GOOD(context_state))
+        {
+            pa_threaded_mainloop_unlock(mainloop);
+            return false;
+        }
+
+        pa_threaded_mainloop_wait(mainloop);
+    }
 
     pa_channel_map map;
     std::memset(&map, 0, sizeof(map));
     pa_channel_map_init_stereo(&map);
 
-    pa_buffer_attr attr;
-    attr.maxlength = params.audio_frame_size * 4;
-    attr.fragsize  = params.audio_frame_size * 4;
-
     pa_sample_spec sample_spec =
     {
         .format = PA_SAMPLE_FLOAT32LE,
-        .rate = 44100,
+        .rate = AUDIO_RATE,
         .channels = 2,
     };
 
-    int perr;
-    std::cout << "Using PulseAudio device: " << (params.audio_source ?: "default") << std::endl;
-    pa = pa_simple_new(NULL, "wf-recorder3", PA_STREAM_RECORD, params.audio_source,
-        "wf-recorder3", &sample_spec, &map, &attr, &perr);
+    stream = pa_stream_new(context, "wf-recorder3", &sample_spec, &map);
+    if (!stream)
+    {
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
+
+    pa_stream_set_state_callback(stream, stream_state_cb, this);
+    pa_stream_set_read_callback(stream, stream_read_cb, this);
+
+    /* Fragments of half an encoder frame, about 12ms. The server picks the
+     * rest of the buffer sizes. */
+    pa_buffer_attr attr;
+    attr.maxlength = (uint32_t)-1;
+    attr.tlength = (uint32_t)-1;
+    attr.prebuf = (uint32_t)-1;
+    attr.minreq = (uint32_t)-1;
+    attr.fragsize = params.audio_frame_size / 2;
 
-    if (!pa)
+    /* Interpolated timing makes pa_stream_get_latency() accurate without
+     * asking the server every time */
+    auto flags = (pa_stream_flags_t)(PA_STREAM_ADJUST_LATENCY |
+        PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE);
+    if (pa_stream_connect_record(stream, params.audio_source, &attr, flags) < 0)
     {
-        std::cerr << "Failed to connect to PulseAudio: " << pa_strerror(perr)
-            << "\nRecording won't have audio" << std::endl;
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
+
+    pa_stream_state_t stream_state;
+    while ((stream_state = pa_stream_get_state(stream)) != PA_STREAM_READY)
+    {
+        if (!PA_STREAM_IS_GOOD(stream_state))
+        {
+            pa_threaded_mainloop_unlock(mainloop);
+            return false;
+        }
+
+        pa_threaded_mainloop_wait(mainloop);
     }
+
+    pa_threaded_mainloop_unlock(mainloop);
+    return true;
 }
 
-bool PulseReader::loop()
+/* Runs on PulseAudio's thread, with the mainloop locked */
+void PulseReader::read_available()
 {
-    static std::vector<char> buffer;
-    buffer.resize(params.audio_frame_size);
+    while (pa_stream_readable_size(stream) > 0)
+    {
+        const void *data;
+        size_t size;
+        if (pa_stream_peek(stream, &data, &size) < 0 || size == 0)
+            return;
+
+        /* For record streams, the latency is the age of the oldest sample
+         * which hasn't been read yet, i.e the first one of the chunk */
+        int64_t usec = get_monotonic_usec();
+        pa_usec_t latency;
+        int negative;
+        if (pa_stream_get_latency(stream, &latency, &negative) == 0)
+            usec += negative ? (int64_t)latency : -(int64_t)latency;
+
+        /* No data means a hole in the stream, which the timestamp of the
+         * next chunk accounts for */
+        if (data && !exit_main_loop)
+        {
+            /* The timestamp goes first, so that it is there as soon as the
+             * mixer thread can pop the samples. Only this thread fills the
+             * ring, so the chunk is sure to fit if there is room now. */
+            if (ring.get_capacity() - ring.get_fill_level() >= size)
+            {
+                AudioTimestamp timestamp = {pushed_bytes, usec};
+                timestamps.push(&timestamp, sizeof(timestamp));
+            }
 
-    int perr;
-    if (pa_simple_read(pa, buffer.data(), buffer.size(), &perr) < 0)
+            /* On overrun the chunk is dropped, the ring keeps the count */
+            if (ring.push(data, size))
+            {
+                size_t frame_size = params.audio_frame_size;
+                bool completed_frame = (pushed_bytes + size) / frame_size > pushed_bytes / frame_size;
+                pushed_bytes += size;
+                if (completed_frame && params.on_frame)
+                    params.on_frame();
+            }
+        }
+
+        pa_stream_drop(stream);
+    }
+}
+
+/* The capture time of the sample at position, from the chunk it belongs to */
+int64_t PulseReader::get_capture_usec(uint64_t position)
+{
+    /* Move on to the last chunk starting at or before position */
+    while (true)
     {
-        std::cerr << "Failed to read from PulseAudio stream: "
-            << pa_strerror(perr) << std::endl;
-        return false;
+        if (!has_next_timestamp)
+            has_next_timestamp = timestamps.pop(&next_timestamp, sizeof(next_timestamp));
+        if (!has_next_timestamp ||
+            (has_current_timestamp && next_timestamp.position > position))
+        {
+            break;
+        }
+
+        current_timestamp = next_timestamp;
+        has_current_timestamp = true;
+        has_next_timestamp = false;
     }
 
-    frame_writer->add_audio(buffer.data());
-    return !exit_main_loop;
+    if (!has_current_timestamp)
+        return get_monotonic_usec();
+
+    auto& chunk = current_timestamp;
+    return chunk.usec +
+        (int64_t)((position - chunk.position) * 1000000 / AUDIO_BYTES_PER_SECOND);
 }
 
-void PulseReader::start()
+bool PulseReader::is_recording() const
 {
-    if (!pa)
-        return;
+    return stream != NULL;
+}
 
-    read_thread = std::thread([=] ()
-    {
-        while (loop());
-    });
+bool PulseReader::has_frame() const
+{
+    return ring.get_fill_level() >= params.audio_frame_size;
+}
+
+int64_t PulseReader::get_frame_usec()
+{
+    return get_capture_usec(popped_bytes);
+}
+
+bool PulseReader::pop_frame(void *buffer)
+{
+    if (!ring.pop(buffer, params.audio_frame_size))
+        return false;
+
+    popped_bytes += params.audio_frame_size;
+    return true;
+}
+
+size_t PulseReader::get_fill_level() const
+{
+    return ring.get_fill_level();
+}
+
+size_t PulseReader::get_capacity() const
+{
+    return ring.get_capacity();
+}
+
+size_t PulseReader::get_nr_overruns() const
+{
+    return ring.get_nr_overruns();
 }
 
 PulseReader::~PulseReader()
 {
-    if (pa)
-        read_thread.join();
+    if (!stream)
+        return;
+
+    pa_threaded_mainloop_lock(mainloop);
+    pa_stream_disconnect(stream);
+    pa_context_disconnect(context);
+    pa_threaded_mainloop_unlock(mainloop);
+    pa_threaded_mainloop_stop(mainloop);
+
+    pa_stream_unref(stream);
+    pa_context_unref(context);
+    pa_threaded_mainloop_free(mainloop);
+
+    std::cerr << "Audio ring of " << (params.audio_source ?: "default")
+        << ": peak " << ring.get_peak_fill_level()
+        << " of " << ring.get_capacity() << " bytes, "
+        << ring.get_nr_overruns() << " overruns ("
+        << ring.get_dropped_bytes() << " bytes dropped)" << std::endl;
 }
@@ -1,30 +1,78 @@
 #ifndef PULSE_HPP
 #define PULSE_HPP
 
-#include <pulse/simple.h>
-#include <pulse/error.h>
-#include <thread>
+#include <pulse/pulseaudio.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "audio-ring.hpp"
 
 struct PulseReaderParams
 {
     size_t audio_frame_size;
     /* Can be NULL */
-    char *audio_source;
+    const char *audio_source;
+    /* Called from PulseAudio's thread each time another complete frame has
+     * been buffered, can be empty */
+    std::function<void()> on_frame;
+};
+
+/* When the sample at a position of the ring's stream was captured */
+struct AudioTimestamp
+{
+    uint64_t position; // bytes pushed to the ring before the sample
+    int64_t usec; // CLOCK_MONOTONIC
 };
 
 class PulseReader
 {
     PulseReaderParams params;
-    pa_simple *pa;
 
-    bool loop();
-    std::thread read_thread;
+    /* The stream is read from the callbacks of PulseAudio's own thread */
+    pa_threaded_mainloop *mainloop = NULL;
+    pa_context *context = NULL;
+    pa_stream *stream = NULL;
+    bool connect();
+    void read_available();
+    static void context_state_cb(pa_context *context, void *data);
+    static void stream_state_cb(pa_stream *stream, void *data);
+    static void stream_read_cb(pa_stream *stream, size_t nbytes, void *data);
+
+    /* Raw PCM handed from the read callback to the mixer thread */
+    AudioRing ring;
+
+    /* Capture times of the chunks in the ring, as AudioTimestamp records
+     * pushed by the read callback, so that it never takes a lock */
+    AudioRing timestamps;
+    uint64_t pushed_bytes = 0;
+
+    /* Only used by the mixer thread: the timestamp of the chunk the next
+     * frame starts in, and the one after it if already popped */
+    AudioTimestamp current_timestamp, next_timestamp;
+    bool has_current_timestamp = false, has_next_timestamp = false;
+    uint64_t popped_bytes = 0;
+    int64_t get_capture_usec(uint64_t position);
 
     public:
     PulseReader(PulseReaderParams params);
     ~PulseReader();
 
-    void start();
+    /* false if the source couldn't be opened */
+    bool is_recording() const;
+
+    /* Only called from the mixer thread. A frame is audio_frame_size bytes
+     * of interleaved stereo float samples. */
+    bool has_frame() const;
+    /* When the first sample of the next frame was captured, on
+     * CLOCK_MONOTONIC. Only valid if has_frame(). */
+    int64_t get_frame_usec();
+    bool pop_frame(void *buffer);
+
+    /* Bytes of captured audio not yet handed to the encoder */
+    size_t get_fill_level() const;
+    size_t get_capacity() const;
+    /* Number of reads dropped because the encoder fell behind */
+    size_t get_nr_overruns() const;
 };
 
 #endif /* end of include guard: PULSE_HPP */
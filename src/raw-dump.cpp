@@ -0,0 +1,235 @@
+#include "raw-dump.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* How many records are mapped at once while writing */
+#define RAW_DUMP_WINDOW_RECORDS 16
+
+static size_t align_up(size_t value)
+{
+    return (value + RAW_DUMP_ALIGN - 1) / RAW_DUMP_ALIGN * RAW_DUMP_ALIGN;
+}
+
+RawDumpWriter::RawDumpWriter(const std::string& file, const FrameShm& layout)
+{
+    fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open raw dump " << file << ": "
+            << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, RAW_DUMP_MAGIC, sizeof(header.magic));
+    header.version = RAW_DUMP_VERSION;
+    header.format = layout.format;
+    header.width = layout.width;
+    header.height = layout.height;
+    header.stride = layout.stride;
+    header.record_size = align_up(RAW_DUMP_PIXELS_OFFSET +
+        (size_t)layout.stride * layout.height);
+
+    end_offset = align_up(sizeof(header));
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        std::cerr << "Failed to write raw dump header: " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+}
+
+void RawDumpWriter::map_window(size_t offset)
+{
+    if (window)
+        munmap(window, window_size);
+
+    window_offset = offset;
+    window_size = (size_t)header.record_size * RAW_DUMP_WINDOW_RECORDS;
+
+    /* Grow the file a window at a time, it is truncated to the real size
+     * when closed */
+    int ret;
+    while ((ret = ftruncate(fd, window_offset + window_size)) < 0 && errno == EINTR) {
+        // No-op
+    }
+
+    void *mapped = MAP_FAILED;
+    if (ret == 0)
+    {
+        mapped = mmap(NULL, window_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, window_offset);
+    }
+
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Failed to grow the raw dump: " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    window = (uint8_t*)mapped;
+}
+
+void RawDumpWriter::add_frame(const FrameShm& frame, int64_t usec, bool y_invert)
+{
+    if (!window || end_offset + header.record_size > window_offset + window_size)
+        map_window(end_offset);
+
+    uint8_t *record = window + (end_offset - window_offset);
+    std::memcpy(record + RAW_DUMP_PIXELS_OFFSET, frame.pixels,
+        (size_t)header.stride * header.height);
+
+    RawDumpRecord info;
+    info.usec = usec;
+    info.flags = y_invert ? RAW_DUMP_FLAG_Y_INVERT : 0;
+    info.sequence = header.nr_frames + 1;
+    std::memcpy(record, &info, sizeof(info));
+
+    /* Keep the RSS from growing with the dump, the pages stay in the page
+     * cache until they are written back */
+    madvise(record, header.record_size, MADV_DONTNEED);
+
+    end_offset += header.record_size;
+    ++header.nr_frames;
+}
+
+uint64_t RawDumpWriter::get_nr_frames() const
+{
+    return header.nr_frames;
+}
+
+RawDumpWriter::~RawDumpWriter()
+{
+    if (window)
+        munmap(window, window_size);
+
+    if (ftruncate(fd, end_offset) < 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        std::cerr << "Failed to finish the raw dump: " << strerror(errno) << std::endl;
+    }
+
+    close(fd);
+}
+
+bool RawDumpReader::is_raw_dump(const std::string& file)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    char magic[8];
+    bool match = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        !std::memcmp(magic, RAW_DUMP_MAGIC, sizeof(magic));
+    close(fd);
+
+    return match;
+}
+
+RawDumpReader::RawDumpReader(const std::string& file)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        std::cerr << "Failed to open raw dump " << file << ": "
+            << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    size = st.st_size;
+    void *mapped = MAP_FAILED;
+    if (size >= sizeof(header))
+        mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << file << " is not a raw dump" << std::endl;
+        std::exit(-1);
+    }
+
+    data = (const uint8_t*)mapped;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, RAW_DUMP_MAGIC, sizeof(header.magic)) ||
+        header.version != RAW_DUMP_VERSION)
+    {
+        std::cerr << file << " is not a raw dump" << std::endl;
+        std::exit(-1);
+    }
+
+    /* get_frame() reads stride * height bytes of pixels, 4 bytes per pixel,
+     * from each record */
+    bool valid_format = header.format == INPUT_FORMAT_BGR0 ||
+        header.format == INPUT_FORMAT_RGB0;
+    uint64_t pixels_size = (uint64_t)std::max(header.stride, 0) * std::max(header.height, 0);
+    if (!valid_format || header.width <= 0 || header.height <= 0 ||
+        header.stride / 4 < header.width ||
+        RAW_DUMP_PIXELS_OFFSET + pixels_size > header.record_size)
+    {
+        std::cerr << file << " has an invalid raw dump header" << std::endl;
+        std::exit(-1);
+    }
+
+    /* The frames are read sequentially, once */
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    size_t first_record = align_up(sizeof(header));
+    uint64_t complete_records = size > first_record ?
+        (size - first_record) / header.record_size : 0;
+
+    nr_frames = header.nr_frames ? header.nr_frames : complete_records;
+    nr_frames = std::min(nr_frames, complete_records);
+
+    /* Records after an unclean stop may be empty or partially written */
+    for (uint64_t i = 0; i < nr_frames; i++)
+    {
+        RawDumpRecord info;
+        std::memcpy(&info, data + first_record + i * header.record_size, sizeof(info));
+        if (info.sequence != (uint32_t)(i + 1))
+        {
+            nr_frames = i;
+            break;
+        }
+    }
+}
+
+RawDumpReader::~RawDumpReader()
+{
+    munmap((void*)data, size);
+}
+
+uint64_t RawDumpReader::get_nr_frames() const
+{
+    return nr_frames;
+}
+
+FrameShm RawDumpReader::get_layout() const
+{
+    FrameShm frame;
+    frame.pixels = NULL;
+    frame.format = (InputFormat)header.format;
+    frame.width = header.width;
+    frame.height = header.height;
+    frame.stride = header.stride;
+    return frame;
+}
+
+FrameShm RawDumpReader::get_frame(uint64_t i, int64_t& usec, bool& y_invert) const
+{
+    const uint8_t *record = data + align_up(sizeof(header)) + i * header.record_size;
+
+    RawDumpRecord info;
+    std::memcpy(&info, record, sizeof(info));
+    usec = info.usec;
+    y_invert = info.flags & RAW_DUMP_FLAG_Y_INVERT;
+
+    FrameShm frame = get_layout();
+    frame.pixels = record + RAW_DUMP_PIXELS_OFFSET;
+    return frame;
+}
@@ -0,0 +1,90 @@
+#ifndef RAW_DUMP_HPP
+#define RAW_DUMP_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "frame-writer.hpp"
+
+/* A raw dump is an append-only file of captured frames, to be encoded later.
+ * It starts with a RawDumpHeader, padded to RAW_DUMP_ALIGN, followed by one
+ * record per frame: a RawDumpRecord, then the pixels at RAW_DUMP_PIXELS_OFFSET
+ * from the start of the record. Records are padded to RAW_DUMP_ALIGN, so that
+ * every record can be mapped on its own. */
+#define RAW_DUMP_MAGIC "WFRAWDMP"
+#define RAW_DUMP_VERSION 3
+#define RAW_DUMP_ALIGN 4096
+#define RAW_DUMP_PIXELS_OFFSET 64
+
+struct RawDumpHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t format; // InputFormat
+    int32_t width, height, stride;
+    uint32_t padding;
+    /* 64 bits since version 3, a stride * height of 4 GiB or more didn't fit */
+    uint64_t record_size;
+    /* Written when the dump is closed. If 0, the dump wasn't closed cleanly
+     * and the frames are counted up to the first incomplete record. */
+    uint64_t nr_frames;
+};
+
+#define RAW_DUMP_FLAG_Y_INVERT 1
+
+struct RawDumpRecord
+{
+    int64_t usec;
+    uint32_t flags;
+    /* Index of the record plus one, truncated to 32 bits. Written after the
+     * pixels, so that a record is complete only if it matches. The file is
+     * grown ahead of the records, zero-filled. */
+    uint32_t sequence;
+};
+
+class RawDumpWriter
+{
+    int fd;
+    RawDumpHeader header;
+
+    /* The mapped part of the file, which new records are copied into */
+    uint8_t *window = NULL;
+    size_t window_offset = 0, window_size = 0;
+    /* Where the next record goes */
+    size_t end_offset;
+
+    void map_window(size_t offset);
+
+    public:
+    /* Exits on failure, like FrameWriter */
+    RawDumpWriter(const std::string& file, const FrameShm& layout);
+    ~RawDumpWriter();
+
+    /* The frame must have the layout given to the constructor */
+    void add_frame(const FrameShm& frame, int64_t usec, bool y_invert);
+
+    uint64_t get_nr_frames() const;
+};
+
+class RawDumpReader
+{
+    const uint8_t *data;
+    size_t size;
+    RawDumpHeader header;
+    uint64_t nr_frames;
+
+    public:
+    /* Exits on failure */
+    RawDumpReader(const std::string& file);
+    ~RawDumpReader();
+
+    static bool is_raw_dump(const std::string& file);
+
+    uint64_t get_nr_frames() const;
+    /* The layout of all frames, without pixels */
+    FrameShm get_layout() const;
+    /* i must be smaller than get_nr_frames() */
+    FrameShm get_frame(uint64_t i, int64_t& usec, bool& y_invert) const;
+};
+
+#endif /* end of include guard: RAW_DUMP_HPP */
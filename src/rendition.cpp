@@ -0,0 +1,60 @@
+#include "rendition.hpp"
+
+Rendition::Rendition(const FrameWriterParams& params)
+{
+    writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
+    thread = std::thread([=] () { encode_loop(); });
+}
+
+Rendition::~Rendition()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    cv.notify_all();
+    thread.join();
+    writer = nullptr;
+}
+
+void Rendition::add_frame(const AVFrame *frame, int64_t usec)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [=] () { return !source; });
+        source = frame;
+        source_usec = usec;
+    }
+
+    cv.notify_all();
+}
+
+void Rendition::wait_source_released()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [=] () { return !source; });
+}
+
+void Rendition::encode_loop()
+{
+    while (true)
+    {
+        int64_t usec;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [=] () { return stopping || source; });
+            if (!source)
+                return;
+
+            /* Scaling happens under the lock, so that the main FrameWriter
+             * can reuse the source as soon as the scaled copy is done */
+            writer->scale_frame(source);
+            source = NULL;
+            usec = source_usec;
+        }
+
+        cv.notify_all();
+        writer->encode_scaled_frame(usec);
+    }
+}
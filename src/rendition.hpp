@@ -0,0 +1,38 @@
+#ifndef RENDITION_HPP
+#define RENDITION_HPP
+
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "frame-writer.hpp"
+
+/* An extra output of a FrameWriter at another size. The frames are scaled
+ * from the converted frames of the main FrameWriter and encoded on a thread
+ * of their own, in parallel with the main encoder. */
+class Rendition
+{
+    std::unique_ptr<FrameWriter> writer;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    /* The frame being scaled, owned by the main FrameWriter */
+    const AVFrame *source = NULL;
+    int64_t source_usec;
+    bool stopping = false;
+
+    void encode_loop();
+
+    public:
+    Rendition(const FrameWriterParams& params);
+    /* Encodes the last frame and flushes the encoder */
+    ~Rendition();
+
+    /* Start scaling and encoding source in the background. source must not
+     * change until wait_source_released() returns. */
+    void add_frame(const AVFrame *source, int64_t usec);
+    void wait_source_released();
+};
+
+#endif /* end of include guard: RENDITION_HPP */
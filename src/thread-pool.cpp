@@ -0,0 +1,115 @@
+#include "thread-pool.hpp"
+#include <pthread.h>
+#include <sched.h>
+
+ThreadPool::ThreadPool(int nr_threads, const std::vector<int>& cpus)
+{
+    for (int i = 0; i < nr_threads; i++)
+    {
+        workers.emplace_back([=] () {
+            if (!cpus.empty())
+                set_thread_affinity(cpus);
+            worker_loop();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    task_cv.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+int ThreadPool::get_nr_threads() const
+{
+    return workers.size();
+}
+
+void ThreadPool::worker_loop()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_cv.wait(lock, [=] () { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--unfinished_tasks == 0)
+            done_cv.notify_all();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        ++unfinished_tasks;
+    }
+
+    task_cv.notify_one();
+}
+
+void ThreadPool::wait_all()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [=] () { return unfinished_tasks == 0; });
+}
+
+void ThreadPool::run_all(const std::vector<std::function<void()>>& batch)
+{
+    if (batch.empty())
+        return;
+
+    size_t remaining = batch.size() - 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < batch.size() - 1; i++)
+        {
+            auto& task = batch[i];
+            tasks.push_back([=, &task, &remaining] () {
+                task();
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0)
+                    done_cv.notify_all();
+            });
+        }
+
+        unfinished_tasks += batch.size() - 1;
+    }
+
+    task_cv.notify_all();
+    batch.back()();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] () { return remaining == 0; });
+}
+
+bool set_thread_affinity(const std::vector<int>& cpus)
+{
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus)
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            return false;
+        CPU_SET(cpu, &mask);
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
@@ -0,0 +1,48 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* A fixed-size set of worker threads that run submitted tasks */
+class ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+
+    std::mutex mutex;
+    std::condition_variable task_cv, done_cv;
+    size_t unfinished_tasks = 0;
+    bool stopping = false;
+
+    void worker_loop();
+
+    public:
+    /* The workers are pinned to cpus if given, otherwise they inherit the
+     * mask of the creating thread */
+    ThreadPool(int nr_threads, const std::vector<int>& cpus = {});
+    ~ThreadPool();
+
+    int get_nr_threads() const;
+
+    /* Run the task on one of the workers */
+    void submit(std::function<void()> task);
+
+    /* Block until all submitted tasks have finished */
+    void wait_all();
+
+    /* Run all tasks in parallel and wait for them to finish. The calling
+     * thread runs the last task itself. Only waits for the tasks of the
+     * batch, so the pool can be shared by several threads. */
+    void run_all(const std::vector<std::function<void()>>& batch);
+};
+
+/* Pin the calling thread to the given CPUs. Threads started by it afterwards
+ * inherit the mask. Returns false if the mask can't be applied. */
+bool set_thread_affinity(const std::vector<int>& cpus);
+
+#endif /* end of include guard: THREAD_POOL_HPP */